@@ -4,15 +4,24 @@
 #include <functional>
 #include <memory>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
+#include <vector>
 
 #include "typedefs.h"
 #include "log.h"
 
+// Set to 0 to compile instruction tracing out of the CPU entirely,
+// otherwise it can be switched on at runtime with CPU::setTracing()
+#ifndef NES_TRACE
+#define NES_TRACE 1
+#endif
+
 
 // circular include if I #include "bus.h"
 // so I'm just going with a declaration
 class Bus;
+class Recompiler;
 
 
 class CPU
@@ -24,13 +33,53 @@ public:
 
     // constructor/destructor
     CPU(Bus& newBus, Logger& newLogger);
-    ~CPU(){};
+    ~CPU();
 
     
     void tick();
+    u64 run(u64 budget);
+    void requestStop();
+    void reset();   // https://www.pagetable.com/?p=410
+
+    // Interrupt inputs, both are sampled between instructions.
+    // NMI is edge triggered and stays latched until it is taken,
+    // IRQ is a shared level triggered line masked by the I flag
+    enum IRQSource : u8 {
+        IRQ_MAPPER = 0x01,
+        IRQ_APU_FRAME = 0x02,
+        IRQ_DMC = 0x04,
+    };
+    void triggerNMI();
+    void setIRQ(IRQSource source, bool asserted);
+
+    // run() stops before executing an instruction at any of these
+    void addBreakpoint(u16 address);
+    void removeBreakpoint(u16 address);
+    bool atBreakpoint();
+
+    // Tracing logs every executed instruction with PC in [first, last]
+    void setTracing(bool enable);
+    void setTraceRange(u16 first, u16 last);
+
+    // bus notifies the CPU when PRG banks may have been remapped
+    void prgBankSwitched();
+
+    // How run() executes code from PRG ROM. RECOMPILER translates blocks
+    // to x86-64 code, VALIDATE runs every instruction through it and then
+    // again in the interpreter from the same state, and drops all blocks
+    // when the two disagree. Hosts without a recompiler get BLOCK_CACHE
+    enum class Backend {
+        INTERPRETER, BLOCK_CACHE, RECOMPILER, VALIDATE
+    };
+    void setBackend(Backend newBackend);
+    Backend getBackend();
+    void flushBlocks();
+    u64 blocksCompiled = 0;
+    u64 blocksInvalidated = 0;
 
     u64 cycles;
     u8 OP;
+    u16 operand;
     u16 PC;
     u16 prevPC;
     u8 SP;
@@ -38,49 +87,94 @@ public:
     u8 X;
     u8 Y;
     u8 P;
+
+    // status bytes test ROMs leave in $02/$03, kept up
+    // to date by a bus watch while running tests
     u8 error1;
     u8 error2;
 
 private:
 
+    // generated code works directly on the fields below
+    friend class Recompiler;
+    std::unique_ptr<Recompiler> recompiler;
+
+    // set by ABX/ABY/IDY when indexing carried into the high byte
+    bool pageCrossed = false;
+
     Bus* bus = nullptr;
     Logger& logger;
 
-    u8 read(u32 address);
-    void write(u32 address, u8 value);
+    // Anything that needs attention between instructions raises a bit
+    // here, so the loop only has to test a single word per instruction
+    enum Event : u8 {
+        EVENT_STOP = 0x01,
+        EVENT_BREAKPOINT = 0x02,
+        EVENT_PRG_SWITCH = 0x04,
+        EVENT_NMI = 0x08,
+        EVENT_IRQ = 0x10,
+    };
+    u8 events = 0;
+    u8 irqSources = 0;
+    std::unordered_set<u16> breakpoints;
+    Backend backend = Backend::BLOCK_CACHE;
+    bool tracing = false;
+    u16 traceFirst = 0x0000;
+    u16 traceLast = 0xFFFF;
+
+    u8 read(u16 address);
+    void write(u16 address, u8 value);
+    void writeBack(u16 address, u8 original, u8 value);
     void execute();
     void fetch();
-    void reset();   // https://www.pagetable.com/?p=410
+    template<bool Trace> u64 runLoop(u64 budget);
+    template<bool Trace> void step();
+    bool handleEvents();
+
+    // events that need handling before the next instruction. An IRQ
+    // held off by I stays raised but does not count until I is cleared
+    u8 pendingEvents(){
+        return (P & 0x04) ? events & ~EVENT_IRQ : events;
+    }
+    void interrupt(u16 vector);
     void logState();
+    void traceState();
+    static const char* const mnemonics[256];
 
     // Flag related methods
     void setCarry(bool val)    {P = (val) ? P | 0x01 : P & ~0x01;}
-    void setZero(bool val)     {P = (val) ? P | 0x02 : P & ~0x02;}
     void setInterrupt(bool val){P = (val) ? P | 0x04 : P & ~0x04;}
     void setDecimal(bool val)  {P = (val) ? P | 0x08 : P & ~0x08;}
     void setBreak(bool val)    {P = (val) ? P | 0x10 : P & ~0x10;}
     void setUnused(bool val)   {P = (val) ? P | 0x20 : P & ~0x20;}
     void setOverflow(bool val) {P = (val) ? P | 0x40 : P & ~0x40;}
-    void setNegative(bool val) {P = (val) ? P | 0x80 : P & ~0x80;}
     void clearFlags(){P = 0;}
 
+    // N and Z are evaluated lazily: instead of updating P, instructions
+    // store the value each flag comes from. N is bit 7 of flagN and Z is
+    // set when flagZ is zero. The bits in P are stale until getStatus()
+    u8 flagN = 0;
+    u8 flagZ = 1;
+    void setNZ(u8 val)         {flagN = val; flagZ = val;}
+    u8 getStatus()             {return (P & ~0x82) | (flagN & 0x80) | (flagZ ? 0 : 0x02);}
+    void setStatus(u8 val)     {P = val; flagN = val; flagZ = ~val & 0x02;}
+
     // Pushing/Pulling to Stack
     u8 pullStack();
     void pushStack(u8 value);
 
     // Addressing modes
-    u32 IMM(); 
-    u32 REL(); 
-    u32 ZPG(); 
-    u32 ZPX(); 
-    u32 ZPY(); 
-    u32 ABS(); 
-    u32 ABX(); 
-    u32 ABY();
-    u32 IND();
-    u32 IDX();
-    u32 IDY();
-    u32 ACC();
+    u16 IMM(); 
+    u16 REL(); 
+    u16 ZPG(); 
+    u16 ZPX(); 
+    u16 ZPY(); 
+    u16 ABS(); 
+    u16 ABX(); 
+    u16 ABY();
+    u16 IND();
+    u16 IDX();
+    u16 IDY();
 
     enum AMode {
         _IMM = 0, 
@@ -97,60 +191,110 @@ private:
         _ACC = 11,
     };
 
-    // handles enum addressing modes and returns correct function
-    u32 getAddress(AMode &mode){
-        switch (mode) {
-            case _IMM: return IMM();
-            case _REL: return REL();
-            case _ZPG: return ZPG();
-            case _ZPX: return ZPX();
-            case _ZPY: return ZPY();
-            case _ABS: return ABS();
-            case _ABX: return ABX();
-            case _ABY: return ABY();
-            case _IND: return IND();
-            case _IDX: return IDX();
-            case _IDY: return IDY();
-            case _ACC: return ACC();
-            default: return 0;
+    // resolves the addressing mode at compile time, so every
+    // instantiation of an instruction calls its mode directly
+    template<AMode Mode>
+    u16 getAddress(){
+        if constexpr (Mode == _IMM) return IMM();
+        else if constexpr (Mode == _REL) return REL();
+        else if constexpr (Mode == _ZPG) return ZPG();
+        else if constexpr (Mode == _ZPX) return ZPX();
+        else if constexpr (Mode == _ZPY) return ZPY();
+        else if constexpr (Mode == _ABS) return ABS();
+        else if constexpr (Mode == _ABX) return ABX();
+        else if constexpr (Mode == _ABY) return ABY();
+        else if constexpr (Mode == _IND) return IND();
+        else if constexpr (Mode == _IDX) return IDX();
+        else {
+            // accumulator shifts never touch memory, see ASL & co.
+            static_assert(Mode == _IDY, "addressing mode has no address");
+            return IDY();
+        }
+    };
+
+    // indexed reads pay an extra cycle when the index crosses a page
+    template<AMode Mode>
+    void addPageCrossCycle(){
+        if constexpr (Mode == _ABX || Mode == _ABY || Mode == _IDY)
+            cycles += pageCrossed;
+    };
+
+    // value an instruction operates on, immediates come
+    // straight from the decoded operand instead of the bus
+    template<AMode Mode>
+    u8 readValue(){
+        if constexpr (Mode == _IMM){
+            PC += 2;
+            return operand;
+        } else {
+            u16 address = getAddress<Mode>();
+            addPageCrossCycle<Mode>();
+            return read(address);
         }
     };
 
+    // one handler per opcode, see the opcode table in 6502.cpp
+    typedef void (CPU::*Instruction)();
+    static const Instruction opcodeTable[256];
+    static const u8 cycleTable[256];
+    static const u8 sizeTable[256];
+
+    // Decoded instructions & block cache
+    struct DecodedInstruction {
+        Instruction handler;
+        u16 operand;
+        u8 opcode;
+        u8 cycles;
+    };
+    typedef std::vector<DecodedInstruction> DecodedBlock;
+    std::unordered_map<u32, DecodedBlock> blockCache;
+
+    DecodedInstruction decode(u16 address);
+    DecodedBlock& getBlock();
+    bool endsBlock(u8 opcode);
+    template<bool Trace> void runBlock(u64 target);
+    void validateNative();
+
     // Instructions
     // Variety of Addressing Modes
-    void ORA(AMode mode); 
-    void AND(AMode mode); 
-    void EOR(AMode mode); 
-    void ADC(AMode mode);
-    void STA(AMode mode); 
-    void LDA(AMode mode); 
-    void CMP(AMode mode); 
-    void SBC(AMode mode);
-    void ASL(AMode mode); 
-    void ROL(AMode mode); 
-    void LSR(AMode mode); 
-    void ROR(AMode mode);
-    void STX(AMode mode); 
-    void LDX(AMode mode); 
-    void DEC(AMode mode); 
-    void INC(AMode mode);
-    void BIT(AMode mode); 
-    void JMP(AMode mode); 
-    void STY(AMode mode); 
-    void LDY(AMode mode); 
-    void CPY(AMode mode); 
-    void CPX(AMode mode);
+    template<AMode Mode> void ORA(); 
+    template<AMode Mode> void AND(); 
+    template<AMode Mode> void EOR(); 
+    template<AMode Mode> void ADC();
+    template<AMode Mode> void STA(); 
+    template<AMode Mode> void LDA(); 
+    template<AMode Mode> void CMP(); 
+    template<AMode Mode> void SBC();
+    template<AMode Mode> void ASL(); 
+    template<AMode Mode> void ROL(); 
+    template<AMode Mode> void LSR(); 
+    template<AMode Mode> void ROR();
+    u8 shiftLeft(u8 M);
+    u8 rotateLeft(u8 M);
+    u8 shiftRight(u8 M);
+    u8 rotateRight(u8 M);
+    template<AMode Mode> void STX(); 
+    template<AMode Mode> void LDX(); 
+    template<AMode Mode> void DEC(); 
+    template<AMode Mode> void INC();
+    template<AMode Mode> void BIT(); 
+    template<AMode Mode> void JMP(); 
+    template<AMode Mode> void STY(); 
+    template<AMode Mode> void LDY(); 
+    template<AMode Mode> void CPY(); 
+    template<AMode Mode> void CPX();
 
     // Branching Instructions
     // Addressing mode is Relative
-    void BPL(AMode mode); 
-    void BMI(AMode mode); 
-    void BVC(AMode mode); 
-    void BVS(AMode mode);
-    void BCC(AMode mode); 
-    void BCS(AMode mode); 
-    void BNE(AMode mode); 
-    void BEQ(AMode mode);
+    void takeBranch();
+    void BPL(); 
+    void BMI(); 
+    void BVC(); 
+    void BVS();
+    void BCC(); 
+    void BCS(); 
+    void BNE(); 
+    void BEQ();
 
     // Interrupt/Subroutine Instructions
     // Addressing Mode is Implied -> No argument
@@ -184,216 +328,8 @@ private:
     void DEX(); 
     void NOP();
 
-    // key opcode maps to correct mnemoic for logging
-    std::unordered_map<u8, std::string> mnemonic = {
-        {0x69, "ADC"},
-        {0x65, "ADC"},
-        {0x75, "ADC"},
-        {0x6D, "ADC"},
-        {0x7D, "ADC"},
-        {0x79, "ADC"},
-        {0x61, "ADC"},
-        {0x71, "ADC"},
-
-        {0x29, "AND"},
-        {0x25, "AND"},
-        {0x35, "AND"},
-        {0x2D, "AND"},
-        {0x3D, "AND"},
-        {0x39, "AND"},
-        {0x21, "AND"},
-        {0x31, "AND"},
-
-        {0x0A, "ASL"},
-        {0x06, "ASL"},
-        {0x16, "ASL"},
-        {0x0E, "ASL"},
-        {0x1E, "ASL"},
-
-        {0x24, "BIT"},
-        {0x2C, "BIT"},
-
-        {0xC9, "CMP"},
-        {0xC5, "CMP"},
-        {0xD5, "CMP"},
-        {0xCD, "CMP"},
-        {0xDD, "CMP"},
-        {0xD9, "CMP"},
-        {0xC1, "CMP"},
-        {0xD1, "CMP"},
-
-        {0xE0, "CPX"},
-        {0xE4, "CPX"},
-        {0xEC, "CPX"},
-
-        {0xC0, "CPY"},
-        {0xC4, "CPY"},
-        {0xCC, "CPY"},
-
-        {0xC6, "DEC"},
-        {0xD6, "DEC"},
-        {0xCE, "DEC"},
-        {0xDE, "DEC"},
-
-        {0x49, "EOR"},
-        {0x45, "EOR"},
-        {0x55, "EOR"},
-        {0x4D, "EOR"},
-        {0x5D, "EOR"},
-        {0x59, "EOR"},
-        {0x41, "EOR"},
-        {0x51, "EOR"},
-
-        {0xE6, "INC"},
-        {0xF6, "INC"},
-        {0xEE, "INC"},
-        {0xFE, "INC"},
-
-        {0x4C, "JMP"},
-        {0x6C, "JMP"},
-
-        {0xA9, "LDA"},
-        {0xA5, "LDA"},
-        {0xB5, "LDA"},
-        {0xAD, "LDA"},
-        {0xBD, "LDA"},
-        {0xB9, "LDA"},
-        {0xA1, "LDA"},
-        {0xB1, "LDA"},
-
-        {0xA2, "LDX"},
-        {0xA6, "LDX"},
-        {0xB6, "LDX"},
-        {0xAE, "LDX"},
-        {0xBE, "LDX"},
-
-        {0xA0, "LDY"},
-        {0xA4, "LDY"},
-        {0xB4, "LDY"},
-        {0xAC, "LDY"},
-        {0xBC, "LDY"},
-
-        {0x4A, "LSR"},
-        {0x46, "LSR"},
-        {0x56, "LSR"},
-        {0x4E, "LSR"},
-        {0x5E, "LSR"},
-
-        {0x09, "ORA"},
-        {0x05, "ORA"},
-        {0x15, "ORA"},
-        {0x0D, "ORA"},
-        {0x1D, "ORA"},
-        {0x19, "ORA"},
-        {0x01, "ORA"},
-        {0x11, "ORA"},
-
-        {0x2A, "ROL"},
-        {0x26, "ROL"},
-        {0x36, "ROL"},
-        {0x2E, "ROL"},
-        {0x3E, "ROL"},
-
-        {0x6A, "ROR"},
-        {0x66, "ROR"},
-        {0x76, "ROR"},
-        {0x6E, "ROR"},
-        {0x7E, "ROR"},
-
-        {0xE9, "SBC"},
-        {0xE5, "SBC"},
-        {0xF5, "SBC"},
-        {0xED, "SBC"},
-        {0xFD, "SBC"},
-        {0xF9, "SBC"},
-        {0xE1, "SBC"},
-        {0xF1, "SBC"},
-
-        {0x85, "STA"},
-        {0x95, "STA"},
-        {0x8D, "STA"},
-        {0x9D, "STA"},
-        {0x99, "STA"},
-        {0x81, "STA"},
-        {0x91, "STA"},
-
-        {0x86, "STX"},
-        {0x96, "STX"},
-        {0x8E, "STX"},
-
-        {0x84, "STY"},
-        {0x94, "STY"},
-        {0x8C, "STY"},
-
-        // BRANCHING
-        {0x90, "BCC"},
-        {0xB0, "BCS"},
-        {0xF0, "BEQ"},
-        {0x30, "BMI"},
-        {0xD0, "BNE"},
-        {0x10, "BPL"},
-        {0x50, "BVC"},
-        {0x70, "BVS"},
-
-
-        // INTERRUPTS
-        {0x00, "BRK"},
-        {0x20, "JSR"},
-        {0x40, "RTI"},
-        {0x60, "RTS"},
-
-        // IMPLIED INSTRUCTIONS
-        {0x18, "CLC"},
-        {0xD8, "CLD"},
-        {0x58, "CLI"},
-        {0xB8, "CLV"},
-        {0xCA, "DEX"},
-        {0x88, "DEY"},
-        {0xE8, "INX"},
-        {0xC8, "INY"},
-        {0x48, "PHA"},
-        {0x08, "PHP"},
-        {0x68, "PLA"},
-        {0x28, "PLP"},
-        {0x38, "SEC"},
-        {0xF8, "SED"},
-        {0x78, "SEI"},
-        {0xAA, "TAX"},
-        {0xA8, "TAY"},
-        {0xBA, "TSX"},
-        {0x8A, "TXA"},
-        {0x9A, "TXS"},
-        {0x98, "TYA"},
-
-        {0xEA, "NOP"},
-        {0x04, "NOP"},
-        {0x44, "NOP"},
-        {0x64, "NOP"},
-        {0x80, "NOP"},
-        {0x82, "NOP"},
-        {0xC2, "NOP"},
-        {0xE2, "NOP"},
-        {0x89, "NOP"},
-        {0x0C, "NOP"},
-        {0x14, "NOP"},
-        {0x34, "NOP"},
-        {0x54, "NOP"},
-        {0x74, "NOP"},
-        {0xD4, "NOP"},
-        {0xF4, "NOP"},
-        {0x1A, "NOP"},
-        {0x3A, "NOP"},
-        {0x5A, "NOP"},
-        {0x7A, "NOP"},
-        {0xDA, "NOP"},
-        {0xFA, "NOP"},
-        {0x1C, "NOP"},
-        {0x3C, "NOP"},
-        {0x5C, "NOP"},
-        {0x7C, "NOP"},
-        {0xDC, "NOP"},
-        {0xFC, "NOP"},
-    };
+    // Unofficial NOPs that still consume an operand
+    template<AMode Mode> void NOP();
 };
 
 
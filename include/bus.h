@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <memory>
+#include <functional>
+#include <vector>
 
 #include "typedefs.h"
 #include "6502.h"
@@ -21,16 +23,91 @@ public:
     void connectCart(Cart& newCart);
     void connectCPU(CPU& newCpu);
     void connectPPU(PPU& newPpu);
-    void write(u16 address, u8 data);
-    u8 read(u16 address);
+    u32 getPrgBank(u16 address);
+    void triggerNMI();
+
+    // RAM and mapped PRG pages are a single indexed load,
+    // everything else goes through the I/O handlers
+    u8 read(u16 address){
+        if (u8* page = readPages[address >> 8])
+            return page[address & 0xFF];
+        return readIO(address);
+    }
+
+    void write(u16 address, u8 data){
+        if (u8* page = writePages[address >> 8]){
+            page[address & 0xFF] = data;
+            return;
+        }
+        writeIO(address, data);
+    }
+
+    // re-points the PRG pages after the mapper switched banks
+    void mapPrg();
+
+    // the page tables behind read() and write(), for the recompiler
+    // which does the same lookups from generated code
+    u8* const* getReadPages(){ return readPages; }
+    u8* const* getWritePages(){ return writePages; }
+
+    // Calls back whenever the guest writes an address in [first, last].
+    // Only pages with a watch on them pay anything on write
+    typedef std::function<void(u16 address, u8 data)> WatchCallback;
+    int addWatch(u16 first, u16 last, WatchCallback callback);
+    void removeWatch(int id);
+
+    // For the validation mode. With a log attached every access that
+    // reaches the I/O handlers is appended to it. With a replay attached
+    // too, reads return the replayed values in order and writes only
+    // take the cycles they took before, so an instruction can be run a
+    // second time without doing its I/O twice
+    struct IOAccess {
+        u16 address;
+        u8 value;
+        bool write;
+        u16 stall;      // cycles the access halted the CPU for
+
+        bool operator==(const IOAccess& other) const;
+    };
+    void logIO(std::vector<IOAccess>* log, const std::vector<IOAccess>* replay = nullptr);
 
 private:
 
+    struct Watch {
+        int id;
+        u16 first;
+        u16 last;
+        WatchCallback callback;
+    };
+    std::vector<Watch> watches;
+    int nextWatchId = 0;
+
+    // number of watches overlapping each 256 byte page,
+    // RAM mirrors included
+    u16 watchedPages[0x100] = {};
+    void markWatch(const Watch& watch, int delta);
+    static bool watchCovers(const Watch& watch, u16 address);
+    void notifyWatches(u16 address, u8 data);
+
+    // Host memory behind each 256 byte page, nullptr for pages that
+    // need a handler. ROM pages are never writable, and pages with
+    // a watch on them lose their write pointer
+    u8* readPages[0x100] = {};
+    u8* writePages[0x100] = {};
+    void mapPage(u8 page);
+    u8 readIO(u16 address);
+    void writeIO(u16 address, u8 data);
+    u8 readDevice(u16 address);
+    void writeDevice(u16 address, u8 data);
+
+    std::vector<IOAccess>* ioLog = nullptr;
+    const std::vector<IOAccess>* ioReplay = nullptr;
+
     Cart* cart = nullptr;
     CPU* cpu = nullptr;
     PPU* ppu = nullptr;
     Logger& logger;
-    u8 mram[0x800];
+    u8 mram[0x800] = {};
 
 };
 
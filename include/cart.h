@@ -1,48 +1,121 @@
 #ifndef NES_CART
 #define NES_CART
 
+#include <algorithm>
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <memory>
+#include <functional>
 
 #include "typedefs.h"
 #include "mappers.h"
+#include "saveram.h"
 #include "log.h"
 
 #define NES_HEADER_SIZE 0x10
-#define VERTICAL_MIRROR true
-#define HORIZONTAL_MIRROR false
+#define NES_TRAINER_SIZE 0x200
+
+// 16 byte tiles in the PPU's $0000-$1FFF pattern tables
+#define CHR_TILE_COUNT 512
+
+// CPU/PPU timing a ROM was made for
+#define TIMING_NTSC 0
+#define TIMING_PAL 1
+#define TIMING_MULTI 2
+#define TIMING_DENDY 3
+
+
+// Everything the header says about the board, sizes in bytes.
+// iNES 1.0 headers leave most of it to guesswork
+struct RomHeader {
+    bool nes20 = false;
+    u16 mapper = 0;
+    u8 submapper = 0;
+    u32 prgRomSize = 0;
+    u32 chrRomSize = 0;
+    u32 prgRamSize = 0;
+    u32 prgNvramSize = 0;
+    u32 chrRamSize = 0;
+    u32 chrNvramSize = 0;
+    u8 mirroring = HORIZONTAL_MIRROR;
+    bool fourScreen = false;
+    bool battery = false;
+    bool trainer = false;
+    u8 timing = TIMING_NTSC;
+};
+
+// false if data doesn't start with an iNES/NES 2.0 header,
+// or the ROM sizes in it are too large to address
+bool parseHeader(const u8* data, RomHeader& header);
 
 
 class Cart
 {
 public:
 
-    bool mirroring;
-
     Cart(Logger& newLogger);
     Cart(char *filename, Logger& newLogger);
     ~Cart();
 
+    // false if the file was unreadable or the board isn't supported,
+    // nothing else may be called on a cart that didn't load
+    bool isLoaded();
+    const RomHeader& getHeader();
+
     u8 read(u16 address);
-    void write(u16 address, u8 data);
+    void write(u16 address, u8 data, u64 cycle);
     u8 readPPU(u16 address);
     void writePPU(u16 address, u8 data);
+
+    // One bit per 16 byte tile of CHR RAM, set when it is written. The
+    // bits go by where a tile sits in CHR RAM rather than the pattern
+    // address it was written through, so a bank mapped into two windows
+    // is dirty in both. A 1KB bank is one word, anything caching decoded
+    // tiles checks a window at a time and clears them all once caught up
+    u64 getChrRamDirty(const u8* bank){
+        return chrDirty[(bank - chrRam.data()) >> 10];
+    }
+    void clearChrRamDirty(){
+        std::fill(chrDirty.begin(), chrDirty.end(), 0);
+    }
+    bool hasChrRam();
+    u32 getPrgBank(u16 address);
+    u8* getPrgPointer(u16 address);
+    bool isPrgRamWritable();
+    const u8* getChrPointer(u16 address);
+    u8 getMirroring();
+    void connectIRQ(std::function<void(bool asserted)> irqLine);
+    bool countsScanlines();
+    void a12Rising();
+    int clocksUntilIrq();
     
 private:
 
     std::unique_ptr<BasicMapper> mapper;
     Logger& logger;
-    u32 prgRomSize;
-    u32 chrRomSize;
-    std::vector<u8> header;
-    std::vector<u8> prgRom;
-    std::vector<u8> chrRom;
-    
-    void getHeaderData(std::ifstream &ifs);
-    void getRomData(std::ifstream &ifs);
-    void getMapper();
+    bool loaded = false;
+    RomHeader header;
+
+    // the whole ROM file, mapped read-only
+    u8* image = nullptr;
+    size_t imageSize = 0;
+
+    // ROM windows point into image, CHR RAM is ours
+    CartMemory prgRom;
+    CartMemory chrRom;
+    std::vector<u8> chrRam;
+    std::vector<u64> chrDirty;
+
+    // PRG RAM either lives in saveRam's mapping or in prgRamStorage
+    CartMemory prgRam;
+    std::vector<u8> prgRamStorage;
+    std::unique_ptr<SaveRam> saveRam;
+
+    bool mapFile(const char* filepath);
+    bool getHeaderData();
+    bool getRomData();
+    void getPrgRam(const std::string& filepath);
+    bool getMapper();
     void printHeader();
 };
 
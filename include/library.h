@@ -0,0 +1,65 @@
+#ifndef NES_LIBRARY
+#define NES_LIBRARY
+
+#include <string>
+#include <vector>
+
+#include "typedefs.h"
+#include "cart.h"
+#include "log.h"
+
+#define LIBRARY_INDEX_FILE "nes_library.idx"
+#define LIBRARY_INDEX_VERSION 1
+
+
+// What the library knows about one ROM file. path, mtime
+// and size identify the file, the rest is derived from it
+struct LibraryEntry {
+    std::string path;
+    s64 mtime = 0;
+    u64 size = 0;
+
+    // false if the file didn't have a valid header,
+    // kept anyway so it isn't looked at again
+    bool valid = false;
+    RomHeader header;
+
+    // of PRG + CHR ROM, without header or trainer
+    u32 crc32 = 0;
+    std::string sha1;
+};
+
+
+class Library
+{
+    /**
+     * ROM library index. Scanning walks directories for .nes files,
+     * hashes and parses them on a pool of worker threads and keeps the
+     * results in an index file. Files whose path, mtime and size match
+     * an indexed entry are taken from the index without being read
+    */
+public:
+
+    Library(Logger& newLogger, const std::string& newIndexPath = LIBRARY_INDEX_FILE);
+    ~Library(){};
+
+    // threads = 0 uses one worker per hardware thread
+    void scan(const std::vector<std::string>& directories, unsigned threads = 0);
+    const std::vector<LibraryEntry>& getEntries();
+
+    // how the last scan went
+    u64 filesHashed = 0;
+    u64 filesReused = 0;
+
+private:
+
+    Logger& logger;
+    std::string indexPath;
+    std::vector<LibraryEntry> entries;
+
+    bool loadIndex();
+    bool saveIndex();
+    static void hashFile(LibraryEntry& entry);
+};
+
+#endif
@@ -1,21 +1,107 @@
 #ifndef NES_MAPPERS
 #define NES_MAPPERS
 
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
 #include "typedefs.h"
 
+#define PRG_WINDOW_SIZE 0x2000
+#define CHR_WINDOW_SIZE 0x0400
+
+// nametable mirroring modes, mappers with a
+// mirroring control can switch between them
+#define HORIZONTAL_MIRROR 0
+#define VERTICAL_MIRROR 1
+#define SINGLE_SCREEN_LOWER 2
+#define SINGLE_SCREEN_UPPER 3
+
+
+// A block of cartridge memory the mapper banks over. ROM points
+// straight into the read-only mapping of the ROM file, so only
+// RAM may ever be written through it
+struct CartMemory {
+    u8* data = nullptr;
+    u32 size = 0;
+};
+
 
 class BasicMapper
 {
+    /**
+     * Mappers only get involved when the game writes one of their
+     * registers, they respond by re-pointing the PRG/CHR windows.
+     * Reads index the windows directly and never reach the mapper
+    */
 public:
 
-    BasicMapper(u8 &_numPrgBanks, u8 &_numChrBanks);
+    BasicMapper(CartMemory prgMemory, CartMemory chrMemory);
     virtual ~BasicMapper() {};
-    virtual u16 getMappedAddress(u16 &address) {};
+
+    // Called for CPU writes to $8000-$FFFF. cycle is the CPU cycle
+    // count of the writing instruction, for mappers that care about timing
+    virtual void writeRegister(u16 address, u8 data, u64 cycle) {};
+
+    // starts out as the header's mirroring
+    u8 mirroring = HORIZONTAL_MIRROR;
+
+    // Scanline counters clock on rising edges of PPU A12. The PPU
+    // filters the edges itself and only bothers mappers that ask
+    virtual void a12Rising() {};
+    bool countsScanlines = false;
+
+    // Clocks left until the counter raises its IRQ, -1 if it won't.
+    // Lets the PPU know how far it can fall behind the CPU
+    virtual int clocksUntilIrq() { return -1; };
+
+    // the mapper's line into the CPU's shared IRQ input
+    std::function<void(bool asserted)> irqLine;
+
+    // $6000-$7FFF PRG RAM, boards with a RAM enable can switch it
+    // off (reads and writes ignored) or write protect it
+    bool prgRamEnabled = true;
+    bool prgRamWritable = true;
+
+    // 8KB windows over $8000-$FFFF
+    u8* prg(u16 address){
+        return prgWindows[(address >> 13) & 0x3] + (address & 0x1FFF);
+    }
+
+    // 1KB windows over $0000-$1FFF of PPU space
+    u8* chr(u16 address){
+        return chrWindows[(address >> 10) & 0x7] + (address & 0x03FF);
+    }
+
+    // which 8KB bank of PRG is mapped at address
+    u32 getPrgBank(u16 address){
+        return prgBanks[(address >> 13) & 0x3];
+    }
 
 protected:
 
-    u8 numPrgBanks = 0;
-    u8 numChrBanks = 0;
+    CartMemory prgRom;
+    CartMemory chrRom;
+
+    // bank counts in units of the window size
+    u32 numPrgBanks = 0;
+    u32 numChrBanks = 0;
+
+    // bank numbers wrap around the memory actually on the board
+    void mapPrg(int window, u32 bank);
+    void mapChr(int window, u32 bank);
+
+    // larger banks are a run of consecutive windows
+    void mapPrg16K(int slot, u32 bank);
+    void mapPrg32K(u32 bank);
+    void mapChr4K(int slot, u32 bank);
+    void mapChr8K(u32 bank);
+
+private:
+
+    u8* prgWindows[4] = {};
+    u8* chrWindows[8] = {};
+    u32 prgBanks[4] = {};
 
 };
 
@@ -24,11 +110,173 @@ class Mapper000: public BasicMapper
 {
 public:
 
-    Mapper000(u8 &_numPrgBanks, u8 &_numChrBanks);
+    Mapper000(CartMemory prgMemory, CartMemory chrMemory);
+
+private:
+};
+
+
+/* Discrete logic boards */
+
+
+// These boards are a latch and a few gates: the byte written anywhere
+// in $8000-$FFFF selects PRG/CHR banks and maybe a single-screen
+// nametable. Each board is a traits struct saying which bits do what,
+// a mask of 0 means the board can't switch that
+struct UxROM {
+    static constexpr bool prg16K = true;    // $8000 switches, $C000 fixed to the last bank
+    static constexpr u8 prgShift = 0, prgMask = 0x0F;
+    static constexpr u8 chrShift = 0, chrMask = 0x00;
+    static constexpr u8 mirrorBit = 0x00;
+    static constexpr bool busConflicts = true;
+};
+
+struct CNROM {
+    static constexpr bool prg16K = false;
+    static constexpr u8 prgShift = 0, prgMask = 0x00;
+    static constexpr u8 chrShift = 0, chrMask = 0x03;
+    static constexpr u8 mirrorBit = 0x00;
+    static constexpr bool busConflicts = true;
+};
+
+struct AxROM {
+    static constexpr bool prg16K = false;
+    static constexpr u8 prgShift = 0, prgMask = 0x07;
+    static constexpr u8 chrShift = 0, chrMask = 0x00;
+    static constexpr u8 mirrorBit = 0x10;
+    static constexpr bool busConflicts = false;
+};
+
+struct ColorDreams {
+    static constexpr bool prg16K = false;
+    static constexpr u8 prgShift = 0, prgMask = 0x03;
+    static constexpr u8 chrShift = 4, chrMask = 0x0F;
+    static constexpr u8 mirrorBit = 0x00;
+    static constexpr bool busConflicts = true;
+};
+
+struct GxROM {
+    static constexpr bool prg16K = false;
+    static constexpr u8 prgShift = 4, prgMask = 0x03;
+    static constexpr u8 chrShift = 0, chrMask = 0x03;
+    static constexpr u8 mirrorBit = 0x00;
+    static constexpr bool busConflicts = true;
+};
+
+
+template<class Board>
+class DiscreteMapper: public BasicMapper
+{
+public:
+
+    DiscreteMapper(CartMemory prgMemory, CartMemory chrMemory)
+        : BasicMapper(prgMemory, chrMemory)
+    {
+        if constexpr (Board::prg16K){
+            mapPrg16K(0, 0);
+            mapPrg16K(1, numPrgBanks / 2 - 1);
+        } else {
+            mapPrg32K(0);
+        }
+        mapChr8K(0);
+    }
+
+    void writeRegister(u16 address, u8 data, u64 cycle) override {
+        // ROM drives the bus too, so the latch sees both values ANDed
+        if constexpr (Board::busConflicts)
+            data &= *prg(address);
+
+        if constexpr (Board::prgMask && Board::prg16K)
+            mapPrg16K(0, (data >> Board::prgShift) & Board::prgMask);
+        else if constexpr (Board::prgMask)
+            mapPrg32K((data >> Board::prgShift) & Board::prgMask);
+
+        if constexpr (Board::chrMask)
+            mapChr8K((data >> Board::chrShift) & Board::chrMask);
+
+        if constexpr (Board::mirrorBit)
+            mirroring = (data & Board::mirrorBit) ? SINGLE_SCREEN_UPPER : SINGLE_SCREEN_LOWER;
+    }
+};
+
+typedef DiscreteMapper<UxROM> Mapper002;
+typedef DiscreteMapper<CNROM> Mapper003;
+typedef DiscreteMapper<AxROM> Mapper007;
+typedef DiscreteMapper<ColorDreams> Mapper011;
+typedef DiscreteMapper<GxROM> Mapper066;
+
+
+class Mapper001: public BasicMapper
+{
+public:
+
+    Mapper001(CartMemory prgMemory, CartMemory chrMemory);
 
-    u16 getMappedAddress(u16 &address) override;
+    void writeRegister(u16 address, u8 data, u64 cycle) override;
 
 private:
+
+    // bits arrive LSB first, the marker bit reaches bit 0 on the 5th write
+    u8 shift = 0x10;
+    u64 lastWriteCycle = 0;
+
+    u8 control = 0x0C;
+    u8 chrBank0 = 0;
+    u8 chrBank1 = 0;
+    u8 prgBank = 0;
+
+    void updateBanks();
 };
 
-#endif
\ No newline at end of file
+
+class Mapper004: public BasicMapper
+{
+public:
+
+    Mapper004(CartMemory prgMemory, CartMemory chrMemory);
+
+    void writeRegister(u16 address, u8 data, u64 cycle) override;
+    void a12Rising() override;
+    int clocksUntilIrq() override;
+
+private:
+
+    u8 bankSelect = 0;
+    u8 banks[8] = {};
+
+    u8 irqLatch = 0;
+    u8 irqCounter = 0;
+    bool irqReload = false;
+    bool irqEnabled = false;
+
+    void updateBanks();
+};
+
+
+/* Mapper registry */
+
+
+// Each mapper registers itself with REGISTER_MAPPER next to its
+// implementation, the cart only ever looks them up by number
+typedef std::unique_ptr<BasicMapper> (*MapperFactory)(CartMemory prgMemory, CartMemory chrMemory);
+
+std::unordered_map<u16, MapperFactory>& mapperRegistry();
+
+// nullptr for boards nobody registered
+std::unique_ptr<BasicMapper> createMapper(u16 number, CartMemory prgMemory, CartMemory chrMemory);
+
+template<class Mapper>
+std::unique_ptr<BasicMapper> makeMapper(CartMemory prgMemory, CartMemory chrMemory){
+    return std::make_unique<Mapper>(prgMemory, chrMemory);
+}
+
+struct MapperRegistration {
+    MapperRegistration(u16 number, MapperFactory factory){
+        mapperRegistry()[number] = factory;
+    }
+};
+
+#define REGISTER_MAPPER(number, type) \
+    static MapperRegistration registerMapper##number(number, makeMapper<type>);
+
+#endif
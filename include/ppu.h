@@ -4,9 +4,20 @@
 #include "typedefs.h"
 #include "log.h"
 #include "cart.h"
+#include "tilecache.h"
 
 #include <GL/glew.h>
 
+// NTSC timing
+#define PPU_DOTS_PER_SCANLINE 341
+#define PPU_SCANLINES_PER_FRAME 262
+#define PPU_VBLANK_SCANLINE 241
+#define PPU_PRERENDER_SCANLINE 261
+#define PPU_DOTS_PER_CPU_CYCLE 3
+
+#define FRAME_WIDTH 256
+#define FRAME_HEIGHT 240
+
 
 // circular include if I #include "bus.h"
 // so I'm just going with a declaration
@@ -21,16 +32,42 @@ public:
     ~PPU();
 
     void connectCart(Cart& newCart);
-    void tick();
+
+    // Advances the PPU by a number of dots. The whole pipeline
+    // runs inside this loop, idle vblank lines are skipped over
+    void run(u64 count);
+
+    // The PPU lags behind the CPU and is only brought up to date when
+    // the CPU can observe it: register accesses, and the CPU cycle
+    // returned by nextEvent() for things the PPU does on its own
+    void catchUp(u64 cycle);
+    u64 nextEvent();
+
+    // the mapper may have pointed CHR somewhere else
+    void chrBanksSwitched(){
+        tilesStale = true;
+    }
+
     void writeToRegisters(u8 reg, u8 value);
     u8 readFromRegisters(u8 reg);
+    void writeOAM(u8 value);
     void write(u16 address, u8 value);
     u8 read(u16 address);
 
-    // temporary functions for hacking away :D
-    GLuint renderNT1();
-    GLuint renderNT2();
-    void loadStuffFromCart();
+    // palette indices of the last finished frame, FRAME_WIDTH x FRAME_HEIGHT
+    const u8* getFrame();
+    GLuint renderFrame();
+
+    u64 dots = 0;
+    u64 frameCount = 0;
+    int scanline = 0;
+    int dot = 0;
+
+    // Visible lines drawn in one go vs. dot by dot. Setting
+    // accurateOnly sends every line down the dot path
+    u64 fastLines = 0;
+    u64 accurateLines = 0;
+    bool accurateOnly = false;
 
 private:
 
@@ -39,24 +76,29 @@ private:
     Logger& logger;
 
     // registers
-    u8 PPUCTRL;
-    u8 PPUMASK;
-    u8 PPUSTATUS;
-    u8 OAMADDR;
-    u8 OAMDATA;
-    u8 PPUSCROLL;
-    u16 VRAMADDR;
-    u16 TRAMADDR;
-    u8 PPUDATA;
-    u8 OAMDMA;
+    u8 PPUCTRL = 0;
+    u8 PPUMASK = 0;
+    u8 PPUSTATUS = 0;
+    u8 OAMADDR = 0;
+
+    // Loopy's internal registers: current and temporary VRAM
+    // address, fine X scroll and the shared write toggle
+    u16 VRAMADDR = 0;
+    u16 TRAMADDR = 0;
+    u8 fineX = 0;
+    bool addressLatch = false;
+
+    // PPUDATA reads lag one behind, and write-only
+    // registers read back whatever was last written
+    u8 readBuffer = 0;
+    u8 openBus = 0;
+    bool oddFrame = false;
 
     // memory tables & such
-    u8 oam[0xFF];
-    u8 nametable1[0x400];
-    u8 nametable2[0x400];
-    u8 patterntable1[0x1000];
-    u8 patterntable2[0x1000];
-    u8 palettetable[0x20];
+    u8 oam[0x100] = {};
+    u8 nametable1[0x400] = {};
+    u8 nametable2[0x400] = {};
+    u8 palettetable[0x20] = {};
     u32 palette[64] = {
 		0x7C7C7C, 0x0000FC, 0x0000BC, 0x4428BC, 0x940084, 0xA80020, 0xA81000, 0x881400,
         0x503000, 0x007800, 0x006800, 0x005800, 0x004058, 0x000000, 0x000000, 0x000000,
@@ -68,19 +110,80 @@ private:
         0xF8D878, 0xD8F878, 0xB8F8B8, 0xB8F8D8, 0x00FCFC, 0xF8D8F8, 0x000000, 0x000000
     };
 
-
-    // other helping variables
-    bool addressLatch;
-
-    void writeVRAM(u8 address, u8 value);
-    u8 readVRAM(u8 address);
-    u32 readFromPalette(u8 pal, u8 index);
+    // background pipeline: the next tile's fetched bytes, and
+    // 16 bit shifters holding the current and next tile
+    u8 nextTileId = 0;
+    u8 nextTileAttribute = 0;
+    u8 nextTileLow = 0;
+    u8 nextTileHigh = 0;
+    u16 patternShiftLow = 0;
+    u16 patternShiftHigh = 0;
+    u16 attributeShiftLow = 0;
+    u16 attributeShiftHigh = 0;
+
+    // sprites found for the next line, patterns already flipped
+    u8 spriteCount = 0;
+    bool spriteZeroInLine = false;
+    u8 spriteX[8] = {};
+    u8 spriteAttribute[8] = {};
+    u8 spriteTile[8] = {};
+    u8 spriteRow[8] = {};
+    u8 spriteLow[8] = {};
+    u8 spriteHigh[8] = {};
+    u8 spriteRowPixels[8][8] = {};
+
+    // OAM entries in range of each visible line, bit n for sprite n
+    u64 lineSprites[FRAME_HEIGHT] = {};
+    u64 lineSpritesValid[(FRAME_HEIGHT + 63) / 64] = {};
+    int lineSpritesHeight = 0;
+    u16 spriteRowAddress[8];
+
+    u8 frame[FRAME_WIDTH * FRAME_HEIGHT] = {};
+
+    // decoded tiles for the line renderer, synced lazily
+    // whenever CHR RAM was written or banks were switched
+    TileCache tileCache;
+    bool tilesStale = true;
+    void syncTiles();
+    const u8* tileRow(u16 address, bool flip);
+
+    // PPU A12 as last seen, the dot it last went low on
+    // and the dot of the last rise that clocked the mapper
+    bool scanlineCounter = false;
+    bool a12High = false;
+    u64 a12LowSince = 0;
+    u64 a12ClockedAt = 0;
+    void updateA12(u16 address);
+    int firstA12Rise();
+    int nextA12Rise(int first);
+
+    bool renderingEnabled(){
+        return PPUMASK & 0x18;
+    }
+    void step();
+    void renderDot();
+    void renderLine();
+    void drawPixel();
+    u8 spritePixel(int slot, int column);
+    u8 spriteFlags(int slot);
+    u8 mixPixel(int x, u8 background, u8 sprite);
+    void shiftBackground(int count = 1);
+    void loadBackground();
+    void fetchNametable();
+    void fetchAttribute();
+    void fetchPattern(bool high);
+    u16 backgroundAddress();
+    void incrementX();
+    void incrementY();
+    void evaluateSprites();
+    u64 spritesOnLine(int height);
+    void fetchSprite(int slot, bool high);
+    u8 paletteAddress(u16 address);
 
     // GL Specific stuff
-    GLuint NT1_id;
-    GLuint NT2_id;
+    GLuint frameTexture;
+    u32 frameRGBA[FRAME_WIDTH * FRAME_HEIGHT];
     void initTexture(GLuint &texture);
-    void updTextureNT1();
 };
 
-#endif                
\ No newline at end of file
+#endif
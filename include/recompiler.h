@@ -0,0 +1,124 @@
+#ifndef NES_RECOMPILER
+#define NES_RECOMPILER
+
+#include <unordered_map>
+#include <vector>
+
+#include "typedefs.h"
+#include "log.h"
+
+class CPU;
+class Bus;
+
+
+class Recompiler
+{
+    /**
+     * Translates decoded blocks from PRG ROM into x86-64 code. A, X, Y and
+     * the cycle counter stay in host registers for the length of a block.
+     * Memory goes through the bus page tables, and any access they do not
+     * cover (I/O, mapper registers, watched pages) calls back into the bus
+     * exactly like the interpreter would. Opcodes without a translation
+     * run their interpreter handler from inside the block
+    */
+public:
+
+    Recompiler(CPU& newCpu, Bus& newBus, Logger& newLogger);
+    ~Recompiler();
+
+    // false if the host has no code generator or no executable memory
+    bool isReady();
+
+    // Runs the block at PC until it ends, the cycle target is reached
+    // or an event needs handling, stopping where CPU::runBlock() would.
+    // False if there is no block at PC and the instruction has to be
+    // interpreted, which CPU::getBlock() leaves to instructions that
+    // straddle two PRG windows
+    bool run(u64 target);
+
+    // drops all translated code, it gets rebuilt on next use
+    void flush();
+
+    // translates one instruction per block, for the validation mode
+    void setSingleStep(bool enable);
+
+    // Everything a single instruction can change, saved and restored
+    // around the interpreter replay in the validation mode
+    struct State {
+        u8 A, X, Y, SP, P;
+        u16 PC;
+        u64 cycles;
+        std::vector<u8> memory;
+
+        bool operator==(const State& other) const;
+    };
+    void save(State& state);
+    void restore(const State& state);
+
+private:
+
+    CPU& cpu;
+    Bus& bus;
+    Logger& logger;
+
+    // one executable buffer, filled front to back and emptied at once.
+    // The entry/exit stubs shared by every block sit at its start
+    u8* code = nullptr;
+    size_t codeUsed = 0;
+    size_t stubsSize = 0;
+    typedef void (*Entry)(CPU* cpu, u64 target, const u8* block);
+    Entry enter = nullptr;
+    const u8* exitStub = nullptr;
+
+    // translated blocks, keyed like the decoded block cache
+    std::unordered_map<u32, const u8*> blocks;
+    bool singleStep = false;
+
+    // byte offsets of the CPU fields the generated code touches
+    s32 offA, offX, offY, offSP, offP, offPC, offCycles;
+    s32 offFlagN, offFlagZ, offOP, offOperand, offEvents;
+    s32 writePagesDelta;
+
+    enum Op : u8 {
+        INTERPRET, NOP,
+        ORA, AND, EOR, ADC, SBC, CMP, CPX, CPY, BIT,
+        LDA, LDX, LDY, STA, STX, STY,
+        ASL, LSR, ROL, ROR, INC, DEC,
+        INX, INY, DEX, DEY, TAX, TAY, TXA, TYA, TSX, TXS,
+        CLC, SEC, CLI, SEI, CLV, CLD, SED,
+        PHA, PHP, PLA, PLP, JMP, JSR, RTS, RTI,
+        BPL, BMI, BVC, BVS, BCC, BCS, BNE, BEQ,
+    };
+    struct Translation {
+        Op op;
+        u8 mode;
+    };
+    static const Translation translations[256];
+
+    class Emitter;
+    void emitStubs();
+    const u8* compile(u16 address);
+    void translate(Emitter& e, u8 opcode, u16 operand, u8 cycles, u16 pc, bool last);
+    void emitAddress(Emitter& e, u8 mode, u16 operand, u16 next, bool read);
+    void emitOperand(Emitter& e, u8 mode, u16 operand, u16 next);
+    void emitRead(Emitter& e, u16 pc);
+    void emitWrite(Emitter& e, u16 pc, bool writeBack);
+    void emitPush(Emitter& e, u16 pc);
+    void emitPull(Emitter& e, u16 pc);
+    void emitStatus(Emitter& e);
+    void emitSetStatus(Emitter& e);
+    void emitSetNZ(Emitter& e, int reg);
+    void emitSetCarry(Emitter& e, int reg);
+    void emitSpill(Emitter& e, u16 pc);
+    void emitCall(Emitter& e, const void* function);
+    void emitCheck(Emitter& e, u16 next, bool events);
+    void emitExit(Emitter& e, u16 pc);
+
+    // called from generated code, with the CPU in the first argument
+    static u8 readSlow(CPU* cpu, u16 address);
+    static void writeSlow(CPU* cpu, u16 address, u8 value);
+    static void writeBackSlow(CPU* cpu, u16 address, u8 original, u8 value);
+    static void interpret(CPU* cpu);
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef NES_SAVERAM
+#define NES_SAVERAM
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "typedefs.h"
+#include "log.h"
+
+// how often the flush thread pushes save RAM out to disk
+#define SAVE_FLUSH_INTERVAL_MS 2000
+
+
+class SaveRam
+{
+    /**
+     * Battery backed PRG RAM, mapped straight from the .sav file.
+     * The game writes the mapping like any other RAM, which lands in
+     * the page cache and survives the process dying. A background
+     * thread msyncs it so it survives the machine dying too, without
+     * the emulation thread ever waiting on the disk. The file is locked
+     * while mapped, a second instance on the same save gets a private
+     * copy that is thrown away when it exits
+    */
+public:
+
+    SaveRam(Logger& newLogger);
+    ~SaveRam();
+
+    // creates or grows the file to size bytes and maps it
+    bool open(const std::string& path, u32 size);
+    u8* getData();
+    u32 getSize();
+
+private:
+
+    Logger& logger;
+    u8* data = nullptr;
+    u32 size = 0;
+
+    // holds the lock, -1 for a private copy
+    int fd = -1;
+
+    std::thread flusher;
+    std::mutex flushMutex;
+    std::condition_variable flushWake;
+    bool stopping = false;
+
+    bool openCopy(int file, const std::string& path, u32 newSize);
+    void flushLoop();
+    void flush();
+};
+
+#endif
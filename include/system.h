@@ -15,9 +15,11 @@
 #include "../include/gui.h"
 #include "../include/bus.h"
 #include "../include/cart.h"
+#include "../include/library.h"
 #include "../include/log.h"
 
 
+
 class System
 {
 public:
@@ -26,12 +28,16 @@ public:
     ~System(){};
 
     // tied to GUI controls
-    void loadCart(char* filepath);
-    void loadCart();
+    bool loadCart(char* filepath);
+    bool loadCart();
+    const std::vector<LibraryEntry>& getLibrary();
 
     // tied to command line arguments
     void setImguiDemo(bool isDemo);
     void setTesting(bool isTesting);
+    void setTraceFrames(u64 first, u64 last);
+    void setTraceRange(u16 first, u16 last);
+    void scanLibrary(const std::vector<std::string>& directories);
 
     // tied to `int main()`
     int mainLoop();
@@ -44,6 +50,7 @@ private:
     std::unique_ptr<PPU> ppu;
     std::unique_ptr<Cart> cart;
     Logger& logger;
+    Library library;
 
     // State Variables
     std::string systemName;
@@ -51,6 +58,12 @@ private:
     bool testMode = false;
     bool cartLoaded = false;
     bool running = false;
+    u64 frameCount = 0;
+
+    // instruction tracing limited to a range of frames
+    bool traceFrames = false;
+    u64 traceFirstFrame = 0;
+    u64 traceLastFrame = 0;
 
     void tick();
     void setRunning(bool isRunning);
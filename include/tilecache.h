@@ -0,0 +1,47 @@
+#ifndef NES_TILECACHE
+#define NES_TILECACHE
+
+#include "typedefs.h"
+#include "cart.h"
+
+// pixels per tile, one byte each
+#define TILE_PIXELS 64
+
+
+class TileCache
+{
+    /**
+     * The 512 tiles of $0000-$1FFF expanded to one byte per pixel (0-3),
+     * along with a horizontally flipped copy, so drawing a row of a
+     * tile is an 8 byte copy. Tiles are decoded on first use and thrown
+     * away when CHR RAM under them is written, or when the mapper points
+     * their 1KB window at another bank
+    */
+public:
+
+    void connectCart(Cart& newCart);
+
+    // row y of a tile, left to right or flipped
+    const u8* row(u16 tile, int y, bool flip){
+        if (!(valid[tile >> 6] & (1ull << (tile & 63))))
+            decode(tile);
+        return &pixels[flip][tile][y * 8];
+    }
+
+    // drops the tiles whose CHR changed since the last sync
+    void sync();
+
+private:
+
+    Cart* cart = nullptr;
+
+    // window pointers the cached tiles were decoded from. A 1KB
+    // window holds 64 tiles, so each window is one word of valid
+    const u8* windows[8] = {};
+    u64 valid[CHR_TILE_COUNT / 64] = {};
+    alignas(32) u8 pixels[2][CHR_TILE_COUNT][TILE_PIXELS];
+
+    void decode(u16 tile);
+};
+
+#endif
@@ -3,22 +3,19 @@
 #include <iomanip>
 #include <iostream>
 
-#include <boost/format.hpp>
-
 #include "../include/6502.h"
 #include "../include/bus.h"
+#include "../include/recompiler.h"
 
-// We define an address outside of 
-// memory for accumulator addressing/reading/writing
-#define ACCUMULATOR_ADDRESS 0xFFFFFFFF
-
-// address of IRQ interrupt vector in memory
-#define IRQ_INTERRUPT 0xFFFE
+// addresses of the interrupt vectors in memory
+#define NMI_VECTOR 0xFFFA
+#define RESET_VECTOR 0xFFFC
+#define IRQ_VECTOR 0xFFFE
 
 
 // constructor
 CPU::CPU(Bus& newBus, Logger& newLogger)
-    : PC(0xFFFC), prevPC(0), SP(0xFD), A(0), X(0), Y(0), P(0x24), cycles(0)
+    : PC(0xFFFC), prevPC(0), SP(0x00), A(0), X(0), Y(0), P(0x24), cycles(0)
     , error1(0), error2(0)
     , bus(&newBus), logger(newLogger)
 {
@@ -26,28 +23,154 @@ CPU::CPU(Bus& newBus, Logger& newLogger)
 }
 
 
+// destructor, out of line since Recompiler is only declared in the header
+CPU::~CPU(){
+}
+
+
 // fetch & execute opcode
 void CPU::tick(){
+    setStatus(P);
+    if (pendingEvents())
+        handleEvents();
+#if NES_TRACE
+    if (tracing)
+        step<true>();
+    else
+#endif
+        step<false>();
+    P = getStatus();
+}
+
+
+// N and Z are only tracked lazily while executing, so P is
+// unpacked on the way into tick()/run() and rebuilt on the way out
+template<bool Trace>
+void CPU::step(){
     fetch();
-    logState();
+    if constexpr (Trace)
+        traceState();
     execute();
-    error1 = read(0x02);
-    error2 = read(0x03);
 }
 
 
+// executes instructions until the cycle budget runs out or
+// something asks the CPU to stop, returns the cycles spent
+u64 CPU::run(u64 budget){
+#if NES_TRACE
+    if (tracing)
+        return runLoop<true>(budget);
+#endif
+    return runLoop<false>(budget);
+}
+
+
+// The run loop is instantiated with and without tracing,
+// so a disabled trace does not cost a single check
+template<bool Trace>
+u64 CPU::runLoop(u64 budget){
+    u64 start = cycles;
+    u64 target = cycles + budget;
+    events &= ~(EVENT_STOP | EVENT_BREAKPOINT);
+    setStatus(P);
+
+    while (cycles < target){
+        if (pendingEvents() && handleEvents())
+            break;
+
+        // code in PRG ROM runs from decoded or recompiled blocks, RAM is
+        // interpreted since it can be rewritten at any time. Breakpoints
+        // have to be checked per instruction so they force single steps,
+        // and traced runs never go native since they log every instruction
+        if (PC >= 0x8000 && breakpoints.empty() && backend != Backend::INTERPRETER){
+            if (Trace || backend == Backend::BLOCK_CACHE)
+                runBlock<Trace>(target);
+            else if (backend == Backend::RECOMPILER){
+                if (!recompiler->run(target))
+                    step<Trace>();
+            }
+            else
+                validateNative();
+        } else {
+            step<Trace>();
+            if (breakpoints.count(PC))
+                events |= EVENT_BREAKPOINT;
+        }
+    }
+    P = getStatus();
+    return cycles - start;
+}
+
+
+// Called between instructions whenever an event bit is up, takes
+// any pending interrupt and returns true if run() has to stop
+bool CPU::handleEvents(){
+    events &= ~EVENT_PRG_SWITCH;
+    if (events & (EVENT_STOP | EVENT_BREAKPOINT))
+        return true;
+
+    // NMI wins if both are pending, the IRQ line stays
+    // asserted and is taken once the NMI handler clears I
+    if (events & EVENT_NMI){
+        events &= ~EVENT_NMI;
+        interrupt(NMI_VECTOR);
+    } else if ((events & EVENT_IRQ) && !(P & 0x04)){
+        interrupt(IRQ_VECTOR);
+    }
+    return false;
+}
+
+
+// ends the current run() after the instruction in flight
+void CPU::requestStop(){
+    events |= EVENT_STOP;
+}
+
+
+void CPU::addBreakpoint(u16 address){
+    breakpoints.insert(address);
+}
+
+
+void CPU::removeBreakpoint(u16 address){
+    breakpoints.erase(address);
+}
+
+
+// true if the last run() ended on a breakpoint
+bool CPU::atBreakpoint(){
+    return events & EVENT_BREAKPOINT;
+}
+
+
+void CPU::setTracing(bool enable){
+    tracing = enable;
+}
+
+
+void CPU::setTraceRange(u16 first, u16 last){
+    traceFirst = first;
+    traceLast = last;
+}
+
+
+// logs the instruction about to execute if it is inside the trace range
+void CPU::traceState(){
+    if (PC >= traceFirst && PC <= traceLast)
+        logState();
+}
+
+
+// Lines end in a plain newline rather than LOG_ENDLINE,
+// flushing the log every instruction is far too slow
 void CPU::logState(){
-    boost::format fmt = boost::format(                              
-        "%1$#04x  %2$#04x         A:%3$#04X  X:%4$#04X  Y:%5$#04X  P:%6$#04X  SP:%7$#04X"
-    ) % (int) PC % (int) OP % (int) A % (int) X % (int) Y % (int) P % (int) SP;
-    //fmt.modify_item(1, std::group(std::setw(4), std::setfill('0')));
     logger \
-        << PC << "  " << OP << "  " << mnemonic[OP] << "     "
+        << PC << "  " << OP << "  " << mnemonics[OP] << "     "
         << "A:" << A << " "
         << "X:" << X << " "
         << "Y:" << Y << " "
-        << "P:" << P << " "
-        << "SP:" << SP << " " << Logger::logType::LOG_ENDLINE;
+        << "P:" << getStatus() << " "
+        << "SP:" << SP << " \n";
 }
 
 
@@ -57,26 +180,22 @@ void CPU::logState(){
 
 
 // Read value at address from memory via bus
-u8 CPU::read(u32 address){
-    if (address == ACCUMULATOR_ADDRESS){
-        return A;
-    }
-    else {
-        u16 trueAddress = (u16) address;
-        return bus->read(trueAddress);
-    }
+u8 CPU::read(u16 address){
+    return bus->read(address);
 }
 
 
 // Write value @ address in memory via bus
-void CPU::write(u32 address, u8 value){
-    if (address == ACCUMULATOR_ADDRESS){
-        A = value;
-    }
-    else {
-        u16 trueAddress = (u16) address;
-        bus->write(trueAddress, value);
-    }
+void CPU::write(u16 address, u8 value){
+    bus->write(address, value);
+}
+
+
+// Read-modify-write instructions store the unmodified value
+// one cycle before the result, mapper registers see both
+void CPU::writeBack(u16 address, u8 original, u8 value){
+    bus->write(address, original);
+    bus->write(address, value);
 }
 
 
@@ -101,230 +220,383 @@ void CPU::pushStack(u8 value){
 
 
 ///////////////////////////////////////////////
-// GIANT SWITCH/CASE FOR INSTRUCTIONS        //
+// Interrupts                                //
 ///////////////////////////////////////////////
 
 
+// Reset runs the interrupt sequence with writes suppressed,
+// so SP drops by 3 without anything landing on the stack
+void CPU::reset(){
+    SP -= 3;
+    setInterrupt(true);
+    PC = read(RESET_VECTOR) | (read(RESET_VECTOR + 1) << 8);
+    cycles += 7;
+}
+
+
+// latched on the falling edge, taken before the next instruction
+void CPU::triggerNMI(){
+    events |= EVENT_NMI;
+}
+
+
+// Every device holding the line down gets its own bit, the
+// line only goes high again once all of them have let go
+void CPU::setIRQ(IRQSource source, bool asserted){
+    if (asserted)
+        irqSources |= source;
+    else
+        irqSources &= ~source;
+
+    if (irqSources)
+        events |= EVENT_IRQ;
+    else
+        events &= ~EVENT_IRQ;
+}
+
+
+// Hardware interrupt entry, same as BRK except that
+// B is pushed clear and the sequence costs 7 extra cycles
+void CPU::interrupt(u16 vector){
+    pushStack((PC & 0xFF00) >> 8);
+    pushStack(PC & 0x00FF);
+    pushStack((getStatus() & ~0x10) | 0x20);
+    setInterrupt(true);
+    PC = read(vector) | (read(vector + 1) << 8);
+    cycles += 7;
+}
+
+
+///////////////////////////////////////////////
+// Opcode Table                              //
+///////////////////////////////////////////////
+
+
+// Every opcode maps straight to a handler instantiated for its addressing
+// mode. Rows are the high nibble, columns the low nibble; anything not
+// implemented (unofficial opcodes) falls back to the single byte NOP.
+constexpr CPU::Instruction CPU::opcodeTable[256] = {
+    /* 0x00 */ &CPU::BRK,       &CPU::ORA<_IDX>, &CPU::NOP,       &CPU::NOP,
+    /* 0x04 */ &CPU::NOP<_ZPG>, &CPU::ORA<_ZPG>, &CPU::ASL<_ZPG>, &CPU::NOP,
+    /* 0x08 */ &CPU::PHP,       &CPU::ORA<_IMM>, &CPU::ASL<_ACC>, &CPU::NOP,
+    /* 0x0C */ &CPU::NOP<_ABS>, &CPU::ORA<_ABS>, &CPU::ASL<_ABS>, &CPU::NOP,
+
+    /* 0x10 */ &CPU::BPL,       &CPU::ORA<_IDY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x14 */ &CPU::NOP<_ZPX>, &CPU::ORA<_ZPX>, &CPU::ASL<_ZPX>, &CPU::NOP,
+    /* 0x18 */ &CPU::CLC,       &CPU::ORA<_ABY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x1C */ &CPU::NOP<_ABX>, &CPU::ORA<_ABX>, &CPU::ASL<_ABX>, &CPU::NOP,
+
+    /* 0x20 */ &CPU::JSR,       &CPU::AND<_IDX>, &CPU::NOP,       &CPU::NOP,
+    /* 0x24 */ &CPU::BIT<_ZPG>, &CPU::AND<_ZPG>, &CPU::ROL<_ZPG>, &CPU::NOP,
+    /* 0x28 */ &CPU::PLP,       &CPU::AND<_IMM>, &CPU::ROL<_ACC>, &CPU::NOP,
+    /* 0x2C */ &CPU::BIT<_ABS>, &CPU::AND<_ABS>, &CPU::ROL<_ABS>, &CPU::NOP,
+
+    /* 0x30 */ &CPU::BMI,       &CPU::AND<_IDY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x34 */ &CPU::NOP<_ZPX>, &CPU::AND<_ZPX>, &CPU::ROL<_ZPX>, &CPU::NOP,
+    /* 0x38 */ &CPU::SEC,       &CPU::AND<_ABY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x3C */ &CPU::NOP<_ABX>, &CPU::AND<_ABX>, &CPU::ROL<_ABX>, &CPU::NOP,
+
+    /* 0x40 */ &CPU::RTI,       &CPU::EOR<_IDX>, &CPU::NOP,       &CPU::NOP,
+    /* 0x44 */ &CPU::NOP<_ZPG>, &CPU::EOR<_ZPG>, &CPU::LSR<_ZPG>, &CPU::NOP,
+    /* 0x48 */ &CPU::PHA,       &CPU::EOR<_IMM>, &CPU::LSR<_ACC>, &CPU::NOP,
+    /* 0x4C */ &CPU::JMP<_ABS>, &CPU::EOR<_ABS>, &CPU::LSR<_ABS>, &CPU::NOP,
+
+    /* 0x50 */ &CPU::BVC,       &CPU::EOR<_IDY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x54 */ &CPU::NOP<_ZPX>, &CPU::EOR<_ZPX>, &CPU::LSR<_ZPX>, &CPU::NOP,
+    /* 0x58 */ &CPU::CLI,       &CPU::EOR<_ABY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x5C */ &CPU::NOP<_ABX>, &CPU::EOR<_ABX>, &CPU::LSR<_ABX>, &CPU::NOP,
+
+    /* 0x60 */ &CPU::RTS,       &CPU::ADC<_IDX>, &CPU::NOP,       &CPU::NOP,
+    /* 0x64 */ &CPU::NOP<_ZPG>, &CPU::ADC<_ZPG>, &CPU::ROR<_ZPG>, &CPU::NOP,
+    /* 0x68 */ &CPU::PLA,       &CPU::ADC<_IMM>, &CPU::ROR<_ACC>, &CPU::NOP,
+    /* 0x6C */ &CPU::JMP<_IND>, &CPU::ADC<_ABS>, &CPU::ROR<_ABS>, &CPU::NOP,
+
+    /* 0x70 */ &CPU::BVS,       &CPU::ADC<_IDY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x74 */ &CPU::NOP<_ZPX>, &CPU::ADC<_ZPX>, &CPU::ROR<_ZPX>, &CPU::NOP,
+    /* 0x78 */ &CPU::SEI,       &CPU::ADC<_ABY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x7C */ &CPU::NOP<_ABX>, &CPU::ADC<_ABX>, &CPU::ROR<_ABX>, &CPU::NOP,
+
+    /* 0x80 */ &CPU::NOP<_IMM>, &CPU::STA<_IDX>, &CPU::NOP<_IMM>, &CPU::NOP,
+    /* 0x84 */ &CPU::STY<_ZPG>, &CPU::STA<_ZPG>, &CPU::STX<_ZPG>, &CPU::NOP,
+    /* 0x88 */ &CPU::DEY,       &CPU::NOP<_IMM>, &CPU::TXA,       &CPU::NOP,
+    /* 0x8C */ &CPU::STY<_ABS>, &CPU::STA<_ABS>, &CPU::STX<_ABS>, &CPU::NOP,
+
+    /* 0x90 */ &CPU::BCC,       &CPU::STA<_IDY>, &CPU::NOP,       &CPU::NOP,
+    /* 0x94 */ &CPU::STY<_ZPX>, &CPU::STA<_ZPX>, &CPU::STX<_ZPY>, &CPU::NOP,
+    /* 0x98 */ &CPU::TYA,       &CPU::STA<_ABY>, &CPU::TXS,       &CPU::NOP,
+    /* 0x9C */ &CPU::NOP,       &CPU::STA<_ABX>, &CPU::NOP,       &CPU::NOP,
+
+    /* 0xA0 */ &CPU::LDY<_IMM>, &CPU::LDA<_IDX>, &CPU::LDX<_IMM>, &CPU::NOP,
+    /* 0xA4 */ &CPU::LDY<_ZPG>, &CPU::LDA<_ZPG>, &CPU::LDX<_ZPG>, &CPU::NOP,
+    /* 0xA8 */ &CPU::TAY,       &CPU::LDA<_IMM>, &CPU::TAX,       &CPU::NOP,
+    /* 0xAC */ &CPU::LDY<_ABS>, &CPU::LDA<_ABS>, &CPU::LDX<_ABS>, &CPU::NOP,
+
+    /* 0xB0 */ &CPU::BCS,       &CPU::LDA<_IDY>, &CPU::NOP,       &CPU::NOP,
+    /* 0xB4 */ &CPU::LDY<_ZPX>, &CPU::LDA<_ZPX>, &CPU::LDX<_ZPY>, &CPU::NOP,
+    /* 0xB8 */ &CPU::CLV,       &CPU::LDA<_ABY>, &CPU::TSX,       &CPU::NOP,
+    /* 0xBC */ &CPU::LDY<_ABX>, &CPU::LDA<_ABX>, &CPU::LDX<_ABY>, &CPU::NOP,
+
+    /* 0xC0 */ &CPU::CPY<_IMM>, &CPU::CMP<_IDX>, &CPU::NOP<_IMM>, &CPU::NOP,
+    /* 0xC4 */ &CPU::CPY<_ZPG>, &CPU::CMP<_ZPG>, &CPU::DEC<_ZPG>, &CPU::NOP,
+    /* 0xC8 */ &CPU::INY,       &CPU::CMP<_IMM>, &CPU::DEX,       &CPU::NOP,
+    /* 0xCC */ &CPU::CPY<_ABS>, &CPU::CMP<_ABS>, &CPU::DEC<_ABS>, &CPU::NOP,
+
+    /* 0xD0 */ &CPU::BNE,       &CPU::CMP<_IDY>, &CPU::NOP,       &CPU::NOP,
+    /* 0xD4 */ &CPU::NOP<_ZPX>, &CPU::CMP<_ZPX>, &CPU::DEC<_ZPX>, &CPU::NOP,
+    /* 0xD8 */ &CPU::CLD,       &CPU::CMP<_ABY>, &CPU::NOP,       &CPU::NOP,
+    /* 0xDC */ &CPU::NOP<_ABX>, &CPU::CMP<_ABX>, &CPU::DEC<_ABX>, &CPU::NOP,
+
+    /* 0xE0 */ &CPU::CPX<_IMM>, &CPU::SBC<_IDX>, &CPU::NOP<_IMM>, &CPU::NOP,
+    /* 0xE4 */ &CPU::CPX<_ZPG>, &CPU::SBC<_ZPG>, &CPU::INC<_ZPG>, &CPU::NOP,
+    /* 0xE8 */ &CPU::INX,       &CPU::SBC<_IMM>, &CPU::NOP,       &CPU::NOP,
+    /* 0xEC */ &CPU::CPX<_ABS>, &CPU::SBC<_ABS>, &CPU::INC<_ABS>, &CPU::NOP,
+
+    /* 0xF0 */ &CPU::BEQ,       &CPU::SBC<_IDY>, &CPU::NOP,       &CPU::NOP,
+    /* 0xF4 */ &CPU::NOP<_ZPX>, &CPU::SBC<_ZPX>, &CPU::INC<_ZPX>, &CPU::NOP,
+    /* 0xF8 */ &CPU::SED,       &CPU::SBC<_ABY>, &CPU::NOP,       &CPU::NOP,
+    /* 0xFC */ &CPU::NOP<_ABX>, &CPU::SBC<_ABX>, &CPU::INC<_ABX>, &CPU::NOP,
+};
+
+
+// Base cycle count for every opcode, same layout as the opcode table.
+// Page crossing and branch penalties are added by the handlers.
+// Unimplemented opcodes run as the single byte NOP and cost 2 cycles.
+const u8 CPU::cycleTable[256] = {
+    /* 0x00 */ 7, 6, 2, 2, 3, 3, 5, 2, 3, 2, 2, 2, 4, 4, 6, 2,
+    /* 0x10 */ 2, 5, 2, 2, 4, 4, 6, 2, 2, 4, 2, 2, 4, 4, 7, 2,
+    /* 0x20 */ 6, 6, 2, 2, 3, 3, 5, 2, 4, 2, 2, 2, 4, 4, 6, 2,
+    /* 0x30 */ 2, 5, 2, 2, 4, 4, 6, 2, 2, 4, 2, 2, 4, 4, 7, 2,
+    /* 0x40 */ 6, 6, 2, 2, 3, 3, 5, 2, 3, 2, 2, 2, 3, 4, 6, 2,
+    /* 0x50 */ 2, 5, 2, 2, 4, 4, 6, 2, 2, 4, 2, 2, 4, 4, 7, 2,
+    /* 0x60 */ 6, 6, 2, 2, 3, 3, 5, 2, 4, 2, 2, 2, 5, 4, 6, 2,
+    /* 0x70 */ 2, 5, 2, 2, 4, 4, 6, 2, 2, 4, 2, 2, 4, 4, 7, 2,
+    /* 0x80 */ 2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2,
+    /* 0x90 */ 2, 6, 2, 2, 4, 4, 4, 2, 2, 5, 2, 2, 2, 5, 2, 2,
+    /* 0xA0 */ 2, 6, 2, 2, 3, 3, 3, 2, 2, 2, 2, 2, 4, 4, 4, 2,
+    /* 0xB0 */ 2, 5, 2, 2, 4, 4, 4, 2, 2, 4, 2, 2, 4, 4, 4, 2,
+    /* 0xC0 */ 2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2,
+    /* 0xD0 */ 2, 5, 2, 2, 4, 4, 6, 2, 2, 4, 2, 2, 4, 4, 7, 2,
+    /* 0xE0 */ 2, 6, 2, 2, 3, 3, 5, 2, 2, 2, 2, 2, 4, 4, 6, 2,
+    /* 0xF0 */ 2, 5, 2, 2, 4, 4, 6, 2, 2, 4, 2, 2, 4, 4, 7, 2,
+};
+
+
+// Instruction length in bytes, same layout as the opcode table.
+// Unimplemented opcodes run as the single byte NOP.
+const u8 CPU::sizeTable[256] = {
+    /* 0x00 */ 1, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    /* 0x10 */ 2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 3, 3, 3, 1,
+    /* 0x20 */ 3, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    /* 0x30 */ 2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 3, 3, 3, 1,
+    /* 0x40 */ 1, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    /* 0x50 */ 2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 3, 3, 3, 1,
+    /* 0x60 */ 1, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    /* 0x70 */ 2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 3, 3, 3, 1,
+    /* 0x80 */ 2, 2, 2, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    /* 0x90 */ 2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 1, 3, 1, 1,
+    /* 0xA0 */ 2, 2, 2, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    /* 0xB0 */ 2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 3, 3, 3, 1,
+    /* 0xC0 */ 2, 2, 2, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    /* 0xD0 */ 2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 3, 3, 3, 1,
+    /* 0xE0 */ 2, 2, 2, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    /* 0xF0 */ 2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 3, 3, 3, 1,
+};
+
+
+// Mnemonic of every opcode for the trace log, same layout as the opcode table
+const char* const CPU::mnemonics[256] = {
+    /* 0x00 */ "BRK", "ORA", "NOP", "NOP", "NOP", "ORA", "ASL", "NOP", "PHP", "ORA", "ASL", "NOP", "NOP", "ORA", "ASL", "NOP",
+    /* 0x10 */ "BPL", "ORA", "NOP", "NOP", "NOP", "ORA", "ASL", "NOP", "CLC", "ORA", "NOP", "NOP", "NOP", "ORA", "ASL", "NOP",
+    /* 0x20 */ "JSR", "AND", "NOP", "NOP", "BIT", "AND", "ROL", "NOP", "PLP", "AND", "ROL", "NOP", "BIT", "AND", "ROL", "NOP",
+    /* 0x30 */ "BMI", "AND", "NOP", "NOP", "NOP", "AND", "ROL", "NOP", "SEC", "AND", "NOP", "NOP", "NOP", "AND", "ROL", "NOP",
+    /* 0x40 */ "RTI", "EOR", "NOP", "NOP", "NOP", "EOR", "LSR", "NOP", "PHA", "EOR", "LSR", "NOP", "JMP", "EOR", "LSR", "NOP",
+    /* 0x50 */ "BVC", "EOR", "NOP", "NOP", "NOP", "EOR", "LSR", "NOP", "CLI", "EOR", "NOP", "NOP", "NOP", "EOR", "LSR", "NOP",
+    /* 0x60 */ "RTS", "ADC", "NOP", "NOP", "NOP", "ADC", "ROR", "NOP", "PLA", "ADC", "ROR", "NOP", "JMP", "ADC", "ROR", "NOP",
+    /* 0x70 */ "BVS", "ADC", "NOP", "NOP", "NOP", "ADC", "ROR", "NOP", "SEI", "ADC", "NOP", "NOP", "NOP", "ADC", "ROR", "NOP",
+    /* 0x80 */ "NOP", "STA", "NOP", "NOP", "STY", "STA", "STX", "NOP", "DEY", "NOP", "TXA", "NOP", "STY", "STA", "STX", "NOP",
+    /* 0x90 */ "BCC", "STA", "NOP", "NOP", "STY", "STA", "STX", "NOP", "TYA", "STA", "TXS", "NOP", "NOP", "STA", "NOP", "NOP",
+    /* 0xA0 */ "LDY", "LDA", "LDX", "NOP", "LDY", "LDA", "LDX", "NOP", "TAY", "LDA", "TAX", "NOP", "LDY", "LDA", "LDX", "NOP",
+    /* 0xB0 */ "BCS", "LDA", "NOP", "NOP", "LDY", "LDA", "LDX", "NOP", "CLV", "LDA", "TSX", "NOP", "LDY", "LDA", "LDX", "NOP",
+    /* 0xC0 */ "CPY", "CMP", "NOP", "NOP", "CPY", "CMP", "DEC", "NOP", "INY", "CMP", "DEX", "NOP", "CPY", "CMP", "DEC", "NOP",
+    /* 0xD0 */ "BNE", "CMP", "NOP", "NOP", "NOP", "CMP", "DEC", "NOP", "CLD", "CMP", "NOP", "NOP", "NOP", "CMP", "DEC", "NOP",
+    /* 0xE0 */ "CPX", "SBC", "NOP", "NOP", "CPX", "SBC", "INC", "NOP", "INX", "SBC", "NOP", "NOP", "CPX", "SBC", "INC", "NOP",
+    /* 0xF0 */ "BEQ", "SBC", "NOP", "NOP", "NOP", "SBC", "INC", "NOP", "SED", "SBC", "NOP", "NOP", "NOP", "SBC", "INC", "NOP",
+};
+
+
 // Exectutes current opcode
 void CPU::execute(){
-    switch (OP) {
-        // MULTIPLE ADDRESSING MODES
-        case 0x69: ADC(_IMM); break;
-        case 0x65: ADC(_ZPG); break;
-        case 0x75: ADC(_ZPX); break;
-        case 0x6D: ADC(_ABS); break;
-        case 0x7D: ADC(_ABX); break;
-        case 0x79: ADC(_ABY); break;
-        case 0x61: ADC(_IDX); break;
-        case 0x71: ADC(_IDY); break;
-
-        case 0x29: AND(_IMM); break;
-        case 0x25: AND(_ZPG); break;
-        case 0x35: AND(_ZPX); break;
-        case 0x2D: AND(_ABS); break;
-        case 0x3D: AND(_ABX); break;
-        case 0x39: AND(_ABY); break;
-        case 0x21: AND(_IDX); break;
-        case 0x31: AND(_IDY); break;
-
-        case 0x0A: ASL(_ACC); break;
-        case 0x06: ASL(_ZPG); break;
-        case 0x16: ASL(_ZPX); break;
-        case 0x0E: ASL(_ABS); break;
-        case 0x1E: ASL(_ABX); break;
-
-        case 0x24: BIT(_ZPG); break;
-        case 0x2C: BIT(_ABS); break;
-
-        case 0xC9: CMP(_IMM); break;
-        case 0xC5: CMP(_ZPG); break;
-        case 0xD5: CMP(_ZPX); break;
-        case 0xCD: CMP(_ABS); break;
-        case 0xDD: CMP(_ABX); break;
-        case 0xD9: CMP(_ABY); break;
-        case 0xC1: CMP(_IDX); break;
-        case 0xD1: CMP(_IDY); break;
-
-        case 0xE0: CPX(_IMM); break;
-        case 0xE4: CPX(_ZPG); break;
-        case 0xEC: CPX(_ABS); break;
-
-        case 0xC0: CPY(_IMM); break;
-        case 0xC4: CPY(_ZPG); break;
-        case 0xCC: CPY(_ABS); break;
-
-        case 0xC6: DEC(_ZPG); break;
-        case 0xD6: DEC(_ZPX); break;
-        case 0xCE: DEC(_ABS); break;
-        case 0xDE: DEC(_ABX); break;
-
-        case 0x49: EOR(_IMM); break;
-        case 0x45: EOR(_ZPG); break;
-        case 0x55: EOR(_ZPX); break;
-        case 0x4D: EOR(_ABS); break;
-        case 0x5D: EOR(_ABX); break;
-        case 0x59: EOR(_ABY); break;
-        case 0x41: EOR(_IDX); break;
-        case 0x51: EOR(_IDY); break;
-
-        case 0xE6: INC(_ZPG); break;
-        case 0xF6: INC(_ZPX); break;
-        case 0xEE: INC(_ABS); break;
-        case 0xFE: INC(_ABX); break;
-
-        case 0x4C: JMP(_ABS); break;
-        case 0x6C: JMP(_IND); break;
-
-        case 0xA9: LDA(_IMM); break;
-        case 0xA5: LDA(_ZPG); break;
-        case 0xB5: LDA(_ZPX); break;
-        case 0xAD: LDA(_ABS); break;
-        case 0xBD: LDA(_ABX); break;
-        case 0xB9: LDA(_ABY); break;
-        case 0xA1: LDA(_IDX); break;
-        case 0xB1: LDA(_IDY); break;
-
-        case 0xA2: LDX(_IMM); break;
-        case 0xA6: LDX(_ZPG); break;
-        case 0xB6: LDX(_ZPY); break;
-        case 0xAE: LDX(_ABS); break;
-        case 0xBE: LDX(_ABY); break;
-
-        case 0xA0: LDY(_IMM); break;       
-        case 0xA4: LDY(_ZPG); break;
-        case 0xB4: LDY(_ZPX); break;
-        case 0xAC: LDY(_ABS); break;
-        case 0xBC: LDY(_ABX); break;
-
-        case 0x4A: LSR(_ACC); break;
-        case 0x46: LSR(_ZPG); break;
-        case 0x56: LSR(_ZPX); break;
-        case 0x4E: LSR(_ABS); break;        
-        case 0x5E: LSR(_ABX); break;
-
-        case 0x09: ORA(_IMM); break;
-        case 0x05: ORA(_ZPG); break;
-        case 0x15: ORA(_ZPX); break;
-        case 0x0D: ORA(_ABS); break;
-        case 0x1D: ORA(_ABX); break;
-        case 0x19: ORA(_ABY); break;
-        case 0x01: ORA(_IDX); break;
-        case 0x11: ORA(_IDY); break;
-
-        case 0x2A: ROL(_ACC); break;
-        case 0x26: ROL(_ZPG); break;
-        case 0x36: ROL(_ZPX); break;
-        case 0x2E: ROL(_ABS); break;
-        case 0x3E: ROL(_ABX); break;
-
-        case 0x6A: ROR(_ACC); break;
-        case 0x66: ROR(_ZPG); break;
-        case 0x76: ROR(_ZPX); break;
-        case 0x6E: ROR(_ABS); break;
-        case 0x7E: ROR(_ABX); break;
-
-        case 0xE9: SBC(_IMM); break;
-        case 0xE5: SBC(_ZPG); break;
-        case 0xF5: SBC(_ZPX); break;
-        case 0xED: SBC(_ABS); break;
-        case 0xFD: SBC(_ABX); break;
-        case 0xF9: SBC(_ABY); break;
-        case 0xE1: SBC(_IDX); break;
-        case 0xF1: SBC(_IDY); break;
-
-        case 0x85: STA(_ZPG); break;
-        case 0x95: STA(_ZPX); break;
-        case 0x8D: STA(_ABS); break;
-        case 0x9D: STA(_ABX); break;
-        case 0x99: STA(_ABY); break;
-        case 0x81: STA(_IDX); break;
-        case 0x91: STA(_IDY); break;
-
-        case 0x86: STX(_ZPG); break;
-        case 0x96: STX(_ZPY); break;
-        case 0x8E: STX(_ABS); break;
-
-        case 0x84: STY(_ZPG); break;
-        case 0x94: STY(_ZPX); break;
-        case 0x8C: STY(_ABS); break;
-
-        // BRANCHING
-        case 0x90: BCC(_REL); break;
-        case 0xB0: BCS(_REL); break;
-        case 0xF0: BEQ(_REL); break;
-        case 0x30: BMI(_REL); break;
-        case 0xD0: BNE(_REL); break;
-        case 0x10: BPL(_REL); break;
-        case 0x50: BVC(_REL); break;
-        case 0x70: BVS(_REL); break;
-
-
-        // INTERRUPTS
-        case 0x00: BRK(); break;
-        case 0x20: JSR(); break;
-        case 0x40: RTI(); break;
-        case 0x60: RTS(); break;
-
-        // IMPLIED INSTRUCTIONS
-        case 0x18: CLC(); break;
-        case 0xD8: CLD(); break;
-        case 0x58: CLI(); break;
-        case 0xB8: CLV(); break;
-        case 0xCA: DEX(); break;
-        case 0x88: DEY(); break;
-        case 0xE8: INX(); break;
-        case 0xC8: INY(); break;
-        case 0x48: PHA(); break;
-        case 0x08: PHP(); break;
-        case 0x68: PLA(); break;
-        case 0x28: PLP(); break;
-        case 0x38: SEC(); break;
-        case 0xF8: SED(); break;
-        case 0x78: SEI(); break;
-        case 0xAA: TAX(); break;
-        case 0xA8: TAY(); break;
-        case 0xBA: TSX(); break;
-        case 0x8A: TXA(); break;
-        case 0x9A: TXS(); break;
-        case 0x98: TYA(); break;
-
-        // various NOP instructions
-        case 0xEA: NOP(); break;
-        case 0x04: NOP(); PC+=1; break;
-        case 0x44: NOP(); PC+=1; break;
-        case 0x64: NOP(); PC+=1; break;
-        case 0x80: NOP(); PC+=1; break;
-        case 0x82: NOP(); PC+=1; break;
-        case 0xC2: NOP(); PC+=1; break;
-        case 0xE2: NOP(); PC+=1; break;
-        case 0x89: NOP(); PC+=1; break;
-        case 0x0C: NOP(); PC+=2; break;
-        case 0x14: NOP(); PC+=1; break;
-        case 0x34: NOP(); PC+=1; break;
-        case 0x54: NOP(); PC+=1; break;
-        case 0x74: NOP(); PC+=1; break;
-        case 0xD4: NOP(); PC+=1; break;
-        case 0xF4: NOP(); PC+=1; break;
-        case 0x1A: NOP(); break;
-        case 0x3A: NOP(); break;
-        case 0x5A: NOP(); break;
-        case 0x7A: NOP(); break;
-        case 0xDA: NOP(); break;
-        case 0xFA: NOP(); break;
-        case 0x1C: NOP(); PC+=2; break;
-        case 0x3C: NOP(); PC+=2; break;
-        case 0x5C: NOP(); PC+=2; break;
-        case 0x7C: NOP(); PC+=2; break;
-        case 0xDC: NOP(); PC+=2; break;
-        case 0xFC: NOP(); PC+=2; break;
-        default: NOP(); break;
-    }
+    cycles += cycleTable[OP];
+    (this->*opcodeTable[OP])();
 }
 
 
-// fetchs opcode at PC address
+// fetchs opcode and operand at PC address
 void CPU::fetch(){
-    OP = read(PC);
+    DecodedInstruction ins = decode(PC);
+    OP = ins.opcode;
+    operand = ins.operand;
+}
+
+
+// reads an instruction and its operand bytes without executing it
+CPU::DecodedInstruction CPU::decode(u16 address){
+    DecodedInstruction ins;
+    ins.opcode = read(address);
+    ins.handler = opcodeTable[ins.opcode];
+    ins.cycles = cycleTable[ins.opcode];
+    switch (sizeTable[ins.opcode]){
+        case 3:  ins.operand = read(address + 1) | (read(address + 2) << 8); break;
+        case 2:  ins.operand = read(address + 1); break;
+        default: ins.operand = 0; break;
+    }
+    return ins;
+}
+
+
+///////////////////////////////////////////////
+// Decoded Block Cache                       //
+///////////////////////////////////////////////
+
+
+// Finds the decoded block starting at PC, decoding it on first use.
+// Blocks are keyed by (PRG bank, PC) so switching banks simply selects
+// other entries, and never extend past the 8KB window they start in,
+// which is the finest granularity any mapper switches PRG at. An
+// instruction whose operand spills into the next window ends the block
+// before it, since that window can switch without this key changing,
+// so a block at the very end of a window can be empty
+CPU::DecodedBlock& CPU::getBlock(){
+    u32 key = (bus->getPrgBank(PC) << 16) | PC;
+    auto cached = blockCache.find(key);
+    if (cached != blockCache.end())
+        return cached->second;
+
+    DecodedBlock& block = blockCache[key];
+    blocksCompiled++;
+    u16 address = PC;
+    while ((address & 0xE000) == (PC & 0xE000)){
+        DecodedInstruction ins = decode(address);
+        if (((address + sizeTable[ins.opcode] - 1) & 0xE000) != (PC & 0xE000))
+            break;
+        block.push_back(ins);
+        address += sizeTable[ins.opcode];
+        if (endsBlock(ins.opcode))
+            break;
+    }
+    return block;
+}
+
+
+// anything that can move PC somewhere other than the next instruction
+bool CPU::endsBlock(u8 opcode){
+    switch (opcode){
+        case 0x10: case 0x30: case 0x50: case 0x70:     // branches
+        case 0x90: case 0xB0: case 0xD0: case 0xF0:
+        case 0x00: case 0x20: case 0x40: case 0x60:     // BRK JSR RTI RTS
+        case 0x4C: case 0x6C:                           // JMP
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+// Executes the block at PC without re-reading it from the bus. Running
+// out of cycles or any pending event (including a possible bank switch)
+// ends the block early; the remaining instructions are simply picked up
+// again from the next lookup. An instruction that straddles two windows
+// is never cached, it's interpreted instead.
+template<bool Trace>
+void CPU::runBlock(u64 target){
+    DecodedBlock& block = getBlock();
+    if (block.empty())
+        return step<Trace>();
+    for (const DecodedInstruction& ins : block){
+        OP = ins.opcode;
+        operand = ins.operand;
+        if constexpr (Trace)
+            traceState();
+        cycles += ins.cycles;
+        (this->*ins.handler)();
+        if (cycles >= target || pendingEvents())
+            break;
+    }
+}
+
+
+// Runs the instruction at PC as recompiled code, then rewinds and runs
+// it in the interpreter. The interpreter gets the values the native run
+// read from I/O and its writes are only logged, so both have to agree on
+// every I/O access as well. A bank switch can't be rewound, so those are
+// left unchecked. On a mismatch the interpreter's registers and memory
+// stand, with the native run's I/O, and all blocks are dropped
+void CPU::validateNative(){
+    Recompiler::State before, native, interpreted;
+    std::vector<Bus::IOAccess> nativeIO, interpretedIO;
+    recompiler->save(before);
+    bus->logIO(&nativeIO);
+    bool ran = recompiler->run(cycles + 1);
+    bus->logIO(nullptr);
+    if (!ran)
+        return step<false>();
+    if (events & EVENT_PRG_SWITCH)
+        return;
+
+    recompiler->save(native);
+    recompiler->restore(before);
+    bus->logIO(&interpretedIO, &nativeIO);
+    step<false>();
+    bus->logIO(nullptr);
+    recompiler->save(interpreted);
+    if (native == interpreted && nativeIO == interpretedIO)
+        return;
+
+    logger << Logger::logType::LOG_WARNING
+        << "Recompiled " << mnemonics[OP] << " at " << before.PC
+        << " disagrees with the interpreter"
+        << Logger::logType::LOG_ENDLINE;
+    flushBlocks();
+}
+
+
+// drops every decoded block, they get rebuilt on next use
+void CPU::flushBlocks(){
+    blocksInvalidated += blockCache.size();
+    blockCache.clear();
+    if (recompiler)
+        recompiler->flush();
+}
+
+
+// the recompiler is only set up once something asks for it
+void CPU::setBackend(Backend newBackend){
+    if (newBackend == Backend::RECOMPILER || newBackend == Backend::VALIDATE){
+        if (!recompiler)
+            recompiler = std::make_unique<Recompiler>(*this, *bus, logger);
+        if (!recompiler->isReady()){
+            logger << Logger::logType::LOG_WARNING
+                << "No recompiler on this host, using the block cache"
+                << Logger::logType::LOG_ENDLINE;
+            newBackend = Backend::BLOCK_CACHE;
+        } else {
+            recompiler->setSingleStep(newBackend == Backend::VALIDATE);
+        }
+    }
+    backend = newBackend;
+    flushBlocks();
+}
+
+
+CPU::Backend CPU::getBackend(){
+    return backend;
+}
+
+
+// called by the bus on writes to cartridge registers, the block
+// being executed may no longer be what is mapped at PC
+void CPU::prgBankSwitched(){
+    events |= EVENT_PRG_SWITCH;
 }
 
 
@@ -334,75 +606,69 @@ void CPU::fetch(){
 
 
 // Immediate
-u32 CPU::IMM(){
+u16 CPU::IMM(){
     u16 temp = PC + 1;
     PC += 2;
     return temp;
 }
 
-// Accumulator
-u32 CPU::ACC(){
-    PC += 1;
-    return ACCUMULATOR_ADDRESS;
-}
-
 // Relative
-u32 CPU::REL(){
+u16 CPU::REL(){
     s32 address = PC;
-    s8 offset = read(PC + 1);
+    s8 offset = operand;
     address += offset + 2;
     return (u16) address;
 }
 
 // Zero Page
-u32 CPU::ZPG(){
-    u8 address = read(PC + 1);
+u16 CPU::ZPG(){
+    u8 address = operand;
     PC += 2;
     return (u16) address;
 }
 
 // Zero Page X
-u32 CPU::ZPX(){
-    u32 address = read(PC + 1);
+u16 CPU::ZPX(){
+    u16 address = operand;
     address = (address + X) & 0xFF;
     PC += 2;
     return address;
 }
 
 // Zero Page Y
-u32 CPU::ZPY(){
-    u32 address = read(PC + 1);
+u16 CPU::ZPY(){
+    u16 address = operand;
     address = (address + Y) & 0xFF;
     PC += 2;
     return address;
 }
 
 // Absolute
-u32 CPU::ABS(){
-    u16 LSN = read(PC + 1);
-    u16 MSN = read(PC + 2);
-    u32 address = LSN + (MSN << 8);
+u16 CPU::ABS(){
+    u16 address = operand;
     PC += 3;
     return address;
 }
 
 // Absolute X
-u32 CPU::ABX(){
-    u32 address = ABS();
-    return address + X;
+u16 CPU::ABX(){
+    u16 base = ABS();
+    u16 address = base + X;
+    pageCrossed = (base ^ address) & 0xFF00;
+    return address;
 }
 
 // Absolute Y
-u32 CPU::ABY(){
-    u32 address = ABS();
-    return address + Y;
+u16 CPU::ABY(){
+    u16 base = ABS();
+    u16 address = base + Y;
+    pageCrossed = (base ^ address) & 0xFF00;
+    return address;
 }
 
 // Indirect
-u32 CPU::IND(){
-    u16 ABS_LSN = read(PC + 1);
-    u16 ABS_MSN = read(PC + 2);
-    u32 ABS_address = (ABS_MSN << 8) + ABS_LSN;
+u16 CPU::IND(){
+    u16 ABS_address = operand;
 
     // AN INDIRECT JUMP MUST NEVER USE A VECTOR BEGINNING ON THE LAST BYTE OF A PAGE
     u16 address, LSN, MSN;
@@ -420,8 +686,8 @@ u32 CPU::IND(){
 }
 
 // Indirect X
-u32 CPU::IDX(){
-    u32 address = (read(PC + 1) + X) & 0xFF;
+u16 CPU::IDX(){
+    u16 address = (operand + X) & 0xFF;
     u16 LSN = read(address);
     u16 MSN = read((address + 1) & 0xFF);
     address = (MSN << 8) + LSN;
@@ -430,11 +696,13 @@ u32 CPU::IDX(){
 }
 
 // Indirect Y
-u32 CPU::IDY(){
-    u16 temp = read(PC + 1);
+u16 CPU::IDY(){
+    u16 temp = operand;
     u16 LSN = read(temp);
     u16 MSN = read((temp + 1) & 0xFF);
-    u32 address = LSN + (MSN << 8) + Y;
+    u16 base = LSN + (MSN << 8);
+    u16 address = base + Y;
+    pageCrossed = (base ^ address) & 0xFF00;
     PC += 2;
     return address;
 }
@@ -446,255 +714,287 @@ u32 CPU::IDY(){
 
 
 // Or (With Accumulator)
-void CPU::ORA(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::ORA(){
+    u8 M = readValue<Mode>();
 
     A = A | M;
-    setZero(A == 0);
-    setNegative(A & 0x80);
+    setNZ(A);
 };
 
 
 // And (With Accumulator)
-void CPU::AND(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::AND(){
+    u8 M = readValue<Mode>();
 
     A = A & M;
-    setZero(A == 0);
-    setNegative(A & 0x80);
+    setNZ(A);
 }
 
 
 // Exclusive Or
-void CPU::EOR(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::EOR(){
+    u8 M = readValue<Mode>();
 
     A = A ^ M;
-    setZero(A == 0);
-    setNegative(A & 0x80);
+    setNZ(A);
 }
 
 
 // Add with Carry
-void CPU::ADC(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::ADC(){
+    u8 M = readValue<Mode>();
     
     u8 C = P & 0x01;
     u16 result = A+M+C;
-    setZero((result & 0xFF) == 0);
+    setNZ(result);
     setCarry(result & 0x100);
-    setNegative(result & 0x80);
     setOverflow(!((M^A) & 0x80) && ((M^result) & 0x80));
     A = (u8) result & 0xFF;
 }
 
 
 // Store Accumulator
-void CPU::STA(CPU::AMode mode){
-    u32 address = getAddress(mode);
+template<CPU::AMode Mode>
+void CPU::STA(){
+    u16 address = getAddress<Mode>();
     write(address, A);
 }
 
 
 // Load to Accumulator
-void CPU::LDA(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::LDA(){
+    u8 M = readValue<Mode>();
 
     A = M;
-    setZero(A == 0);
-    setNegative(A & 0x80);
+    setNZ(A);
 }
 
 
 // Compare
-void CPU::CMP(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::CMP(){
+    u8 M = readValue<Mode>();
 
     u8 result = A - M;
     setCarry(A >= M);
-    setZero(A == M);
-    setNegative(result & 0x80);
+    setNZ(result);
 }
 
 
 // Subtract With Carry
-void CPU::SBC(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address) ^ 0xFF;
+template<CPU::AMode Mode>
+void CPU::SBC(){
+    u8 M = readValue<Mode>() ^ 0xFF;
     
     u8 C = P & 0x01;
     u16 result = A+M+C;
-    setZero((result & 0xFF) == 0);
+    setNZ(result);
     setCarry(result & 0x100);
-    setNegative(result & 0x80);
     setOverflow((result ^ A) & ((result ^ M) & 0x80));
     A = (u8) result & 0xFF;
 }
 
 
 // Arithmetic Shift Left
-void CPU::ASL(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::ASL(){
+    if constexpr (Mode == _ACC){
+        A = shiftLeft(A);
+        PC += 1;
+    } else {
+        u16 address = getAddress<Mode>();
+        u8 M = read(address);
+        writeBack(address, M, shiftLeft(M));
+    }
+}
+
 
+// Rotate Left
+template<CPU::AMode Mode>
+void CPU::ROL(){
+    if constexpr (Mode == _ACC){
+        A = rotateLeft(A);
+        PC += 1;
+    } else {
+        u16 address = getAddress<Mode>();
+        u8 M = read(address);
+        writeBack(address, M, rotateLeft(M));
+    }
+}
+
+
+// Logical Shift Right
+template<CPU::AMode Mode>
+void CPU::LSR(){
+    if constexpr (Mode == _ACC){
+        A = shiftRight(A);
+        PC += 1;
+    } else {
+        u16 address = getAddress<Mode>();
+        u8 M = read(address);
+        writeBack(address, M, shiftRight(M));
+    }
+}
+
+
+// Rotate Right
+template<CPU::AMode Mode>
+void CPU::ROR(){
+    if constexpr (Mode == _ACC){
+        A = rotateRight(A);
+        PC += 1;
+    } else {
+        u16 address = getAddress<Mode>();
+        u8 M = read(address);
+        writeBack(address, M, rotateRight(M));
+    }
+}
+
+
+// Shift/rotate arithmetic shared by the accumulator
+// and memory forms of ASL, ROL, LSR and ROR
+u8 CPU::shiftLeft(u8 M){
     setCarry(M & 0x80);
     M = M << 1;
-    setZero(M == 0);
-    setNegative(M & 0x80);
-    write(address, M);
+    setNZ(M);
+    return M;
 }
 
 
-// Rotate Left
-void CPU::ROL(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
-
+u8 CPU::rotateLeft(u8 M){
     u8 C = P & 0x01;
     bool carry = M & 0x80;
     M = (M << 1) + C;
-    setZero(M == 0);
+    setNZ(M);
     setCarry(carry);
-    setNegative(M & 0x80);
-    write(address, M);
+    return M;
 }
 
 
-// Logical Shift Right
-void CPU::LSR(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
-
+u8 CPU::shiftRight(u8 M){
     bool carry = M & 1;
     M = M >> 1;
     setCarry(carry);
-    setZero(M == 0);
-    setNegative(M & 0x80);
-    write(address, M);
+    setNZ(M);
+    return M;
 }
 
 
-// Rotate Right
-void CPU::ROR(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
-    
+u8 CPU::rotateRight(u8 M){
     u8 C = P & 0x01;
     bool carry = M & 1;
     M = (M >> 1) + (C << 7);
     setCarry(carry);
-    setZero(M == 0);
-    setNegative(M & 0x80);
-    write(address, M);
+    setNZ(M);
+    return M;
 }
 
 
 // Store X Register
-void CPU::STX(CPU::AMode mode){
-    u32 address = getAddress(mode);
+template<CPU::AMode Mode>
+void CPU::STX(){
+    u16 address = getAddress<Mode>();
     write(address, X);
 }
 
 
 // Load X Register
-void CPU::LDX(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::LDX(){
+    u8 M = readValue<Mode>();
 
     X = M;
-    setZero(X == 0);
-    setNegative(X & 0x80);
+    setNZ(X);
 }
 
 
 // Decrement Memory
-void CPU::DEC(CPU::AMode mode){
-    u32 address = getAddress(mode);
+template<CPU::AMode Mode>
+void CPU::DEC(){
+    u16 address = getAddress<Mode>();
     u8 M = read(address);
     
-    M = M - 1;
-    setZero(M == 0);
-    setNegative(M & 0x80);
-    write(address, M);
+    u8 result = M - 1;
+    setNZ(result);
+    writeBack(address, M, result);
 }
 
 
 // Increment Memory
-void CPU::INC(CPU::AMode mode){
-    u32 address = getAddress(mode);
+template<CPU::AMode Mode>
+void CPU::INC(){
+    u16 address = getAddress<Mode>();
     u8 M = read(address);
     
-    M = M + 1;
-    setZero(M == 0);
-    setNegative(M & 0x80);
-    write(address, M);
+    u8 result = M + 1;
+    setNZ(result);
+    writeBack(address, M, result);
 }
 
 
 // Bit Test
-void CPU::BIT(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::BIT(){
+    u8 M = readValue<Mode>();
     u8 result = M & A;
 
-    setNegative(M & 0x80);
+    // the one place N and Z come from different values
+    flagN = M;
     setOverflow(M & 0x40);
-    setZero((result) == 0);
+    flagZ = result;
 }
 
 
 // Jump
-void CPU::JMP(CPU::AMode mode){
-    u32 address = getAddress(mode);
+template<CPU::AMode Mode>
+void CPU::JMP(){
+    u16 address = getAddress<Mode>();
     PC = address;
 }
 
 
 // Store Y Register
-void CPU::STY(CPU::AMode mode){
-    u32 address = getAddress(mode);
+template<CPU::AMode Mode>
+void CPU::STY(){
+    u16 address = getAddress<Mode>();
     write(address, Y);
 }
 
 
 // Load Y Register
-void CPU::LDY(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::LDY(){
+    u8 M = readValue<Mode>();
 
     Y = M;
-    setZero(Y == 0);
-    setNegative(Y & 0x80);
+    setNZ(Y);
 }
 
 
 // Compare Y Register
-void CPU::CPY(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::CPY(){
+    u8 M = readValue<Mode>();
     
     u8 result = Y - M;
     setCarry(Y >= M);
-    setZero(Y == M);
-    setNegative(result & 0x80);
+    setNZ(result);
 }
 
 
 // Compare X Register
-void CPU::CPX(CPU::AMode mode){
-    u32 address = getAddress(mode);
-    u8 M = read(address);
+template<CPU::AMode Mode>
+void CPU::CPX(){
+    u8 M = readValue<Mode>();
     
     u8 result = X - M;
     setCarry(X >= M);
-    setZero(result == 0);
-    setNegative(result & 0x80);
+    setNZ(result);
 }
 
 
@@ -703,10 +1003,20 @@ void CPU::CPX(CPU::AMode mode){
 ///////////////////////////////////////////////
 
 
+// Taken branches cost one extra cycle, two if the
+// target lies on a different page than the next instruction
+void CPU::takeBranch(){
+    u16 next = PC + 2;
+    u16 target = REL();
+    cycles += ((next ^ target) & 0xFF00) ? 2 : 1;
+    PC = target;
+}
+
+
 // Branch if Positive
-void CPU::BPL(CPU::AMode mode){
-    if (!(P & 0x80)) {
-        PC = getAddress(mode);
+void CPU::BPL(){
+    if (!(flagN & 0x80)) {
+        takeBranch();
     }
     else {
         PC += 2;
@@ -715,9 +1025,9 @@ void CPU::BPL(CPU::AMode mode){
 
 
 // Branch if Minus
-void CPU::BMI(CPU::AMode mode){
-    if (P & 0x80) {
-        PC = getAddress(mode);
+void CPU::BMI(){
+    if (flagN & 0x80) {
+        takeBranch();
     }
     else {
         PC += 2;
@@ -726,9 +1036,9 @@ void CPU::BMI(CPU::AMode mode){
 
 
 // Branch if Overflow Clear
-void CPU::BVC(CPU::AMode mode){
+void CPU::BVC(){
     if (!(P & 0x40)) {
-        PC = getAddress(mode);
+        takeBranch();
     }
     else {
         PC += 2;
@@ -737,9 +1047,9 @@ void CPU::BVC(CPU::AMode mode){
 
 
 // Branch if Overflow Set
-void CPU::BVS(CPU::AMode mode){
+void CPU::BVS(){
     if (P & 0x40) {
-        PC = getAddress(mode);
+        takeBranch();
     }
     else {
         PC += 2;
@@ -748,9 +1058,9 @@ void CPU::BVS(CPU::AMode mode){
 
 
 // Branch if Carry Clear
-void CPU::BCC(CPU::AMode mode){
+void CPU::BCC(){
     if (!(P & 0x01)) {
-        PC = getAddress(mode);
+        takeBranch();
     }
     else {
         PC += 2;
@@ -759,9 +1069,9 @@ void CPU::BCC(CPU::AMode mode){
 
 
 // Branch if Carry Set
-void CPU::BCS(CPU::AMode mode){
+void CPU::BCS(){
     if (P & 0x01) {
-        PC = getAddress(mode);
+        takeBranch();
     }
     else {
         PC += 2;
@@ -770,9 +1080,9 @@ void CPU::BCS(CPU::AMode mode){
 
 
 // Branch if Not Equal
-void CPU::BNE(CPU::AMode mode){
-    if (!(P & 0x02)) {
-        PC = getAddress(mode);
+void CPU::BNE(){
+    if (flagZ) {
+        takeBranch();
     }
     else {
         PC += 2;
@@ -781,9 +1091,9 @@ void CPU::BNE(CPU::AMode mode){
 
 
 // Branch if Equal
-void CPU::BEQ(CPU::AMode mode){
-    if (P & 0x02) {
-        PC = getAddress(mode);
+void CPU::BEQ(){
+    if (!flagZ) {
+        takeBranch();
     }
     else {
         PC += 2;
@@ -797,18 +1107,19 @@ void CPU::BEQ(CPU::AMode mode){
 
 // Force Interrupt
 void CPU::BRK(){
-    // push stuff onto the stack
-    pushStack(PC & 0x00FF);
-    pushStack((PC & 0xFF00) >> 8);
-    pushStack(P | 0x30);
-    PC = IRQ_INTERRUPT;
+    // BRK skips a padding byte, so the return address is PC + 2
+    u16 address = PC + 2;
+    pushStack((address & 0xFF00) >> 8);
+    pushStack(address & 0x00FF);
+    pushStack(getStatus() | 0x30);
+    setInterrupt(true);
+    PC = read(IRQ_VECTOR) | (read(IRQ_VECTOR + 1) << 8);
 }
 
 
 // Jump to Subroutine
 void CPU::JSR(){
-    AMode mode = _ABS;
-    u32 address = getAddress(mode);
+    u16 address = ABS();
     pushStack(((PC-1) & 0xFF00) >> 8);
     pushStack((PC-1) & 0x00FF);
     PC = (u16) address;
@@ -817,14 +1128,18 @@ void CPU::JSR(){
 
 // Return from Interrupt
 void CPU::RTI(){
-    P = (pullStack() & ~0x10) | 0x20;
-    PC = pullStack() + (pullStack() << 8);
+    setStatus((pullStack() & ~0x10) | 0x20);
+    u8 LSN = pullStack();
+    u8 MSN = pullStack();
+    PC = LSN | (MSN << 8);
 }
 
 
 // Return from Subroutine
 void CPU::RTS(){
-    PC = pullStack() + (pullStack() << 8) + 1;
+    u8 LSN = pullStack();
+    u8 MSN = pullStack();
+    PC = (LSN | (MSN << 8)) + 1;
 }
 
 ///////////////////////////////////////////////
@@ -834,14 +1149,14 @@ void CPU::RTS(){
 
 // Push Processor Status
 void CPU::PHP(){
-    pushStack(P | 0x30);
+    pushStack(getStatus() | 0x30);
     PC += 1;
 }
 
 
 // Pull Processor Status
 void CPU::PLP(){
-    P = (pullStack() & ~0x10) | 0x20;
+    setStatus((pullStack() & ~0x10) | 0x20);
     PC += 1;
 }
 
@@ -856,8 +1171,7 @@ void CPU::PHA(){
 // Pull Accumulator
 void CPU::PLA(){
     A = pullStack();
-    setZero(A == 0);
-    setNegative(A & 0x80);
+    setNZ(A);
     PC += 1;
 }
 
@@ -865,8 +1179,7 @@ void CPU::PLA(){
 // Decrement Y Register
 void CPU::DEY(){
     Y = Y - 1;
-    setZero(Y == 0);
-    setNegative(Y & 0x80);
+    setNZ(Y);
     PC += 1;
 }
 
@@ -874,8 +1187,7 @@ void CPU::DEY(){
 // Transfer Accumulator to Y
 void CPU::TAY(){
     Y = A;
-    setZero(Y == 0);
-    setNegative(Y & 0x80);
+    setNZ(Y);
     PC += 1;
 }
 
@@ -883,8 +1195,7 @@ void CPU::TAY(){
 // Increment Y
 void CPU::INY(){
     Y = Y + 1;
-    setZero(Y == 0);
-    setNegative(Y & 0x80);
+    setNZ(Y);
     PC += 1;
 }
 
@@ -892,8 +1203,7 @@ void CPU::INY(){
 // Increment X
 void CPU::INX(){
     X = X + 1;
-    setZero(X == 0);
-    setNegative(X & 0x80);
+    setNZ(X);
     PC += 1;
 }
 
@@ -929,8 +1239,7 @@ void CPU::SEI(){
 // Transfer Y to Accumulator
 void CPU::TYA(){
     A = Y;
-    setZero(Y == 0);
-    setNegative(Y & 0x80);
+    setNZ(Y);
     PC += 1;
 }
 
@@ -959,8 +1268,7 @@ void CPU::SED(){
 // Transfer X to Accumulator
 void CPU::TXA(){
     A = X;
-    setZero(A == 0);
-    setNegative(A & 0x80);
+    setNZ(A);
     PC += 1;
 }
 
@@ -975,8 +1283,7 @@ void CPU::TXS(){
 // Transfer Accumulator to X
 void CPU::TAX(){
     X = A;
-    setZero(X == 0);
-    setNegative(X & 0x80);
+    setNZ(X);
     PC += 1;
 }
 
@@ -984,8 +1291,7 @@ void CPU::TAX(){
 // Transfer Stack Pointer to X
 void CPU::TSX(){
     X = SP;
-    setZero(X == 0);
-    setNegative(X & 0x80);
+    setNZ(X);
     PC += 1;
 }
 
@@ -993,8 +1299,7 @@ void CPU::TSX(){
 // Decrement X Register
 void CPU::DEX(){
     X = X - 1;
-    setZero(X == 0);
-    setNegative(X & 0x80);
+    setNZ(X);
     PC += 1;
 }
 
@@ -1002,4 +1307,12 @@ void CPU::DEX(){
 // No Operation
 void CPU::NOP(){
     PC += 1;
+}
+
+
+// No Operation (unofficial, skips its operand bytes)
+template<CPU::AMode Mode>
+void CPU::NOP(){
+    getAddress<Mode>();
+    addPageCrossCycle<Mode>();
 }
\ No newline at end of file
@@ -9,7 +9,11 @@
 
 
 Bus::Bus(Logger& newLogger)
-    : logger(newLogger){}
+    : logger(newLogger)
+{
+    for (int page = 0; page < 0x100; page++)
+        mapPage(page);
+}
 
 
 Bus::~Bus(){}
@@ -17,6 +21,10 @@ Bus::~Bus(){}
 
 void Bus::connectCart(Cart& newCart){
     cart = &newCart;
+    cart->connectIRQ([this](bool asserted){
+        cpu->setIRQ(CPU::IRQ_MAPPER, asserted);
+    });
+    mapPrg();
 }
 
 
@@ -30,32 +38,199 @@ void Bus::connectPPU(PPU& newPpu){
 }
 
 
-void Bus::write(u16 address, u8 data){
+// Builds the host pointers for one page. RAM is mirrored
+// every 2KB so each mirror points at the same memory
+void Bus::mapPage(u8 page){
+    u16 address = page << 8;
+    u8* memory = nullptr;
+    if (address < 0x2000)
+        memory = &mram[address & 0x07FF];
+    else if (address >= 0x6000 && cart)
+        memory = cart->getPrgPointer(address);
+
+    // internal RAM and PRG RAM are writable unless the mapper
+    // protects it, PRG ROM never is
+    bool writable = address < 0x2000
+        || (address >= 0x6000 && address < 0x8000 && cart && cart->isPrgRamWritable());
+    readPages[page] = memory;
+    writePages[page] = (writable && !watchedPages[page]) ? memory : nullptr;
+}
+
+
+void Bus::mapPrg(){
+    for (int page = 0x60; page < 0x100; page++)
+        mapPage(page);
+}
+
+
+// slow path for pages without a write pointer
+void Bus::writeIO(u16 address, u8 data){
+    if (!ioLog)
+        return writeDevice(address, data);
+
+    u64 start = cpu->cycles;
+    if (!ioReplay)
+        writeDevice(address, data);
+    else if (ioLog->size() < ioReplay->size())
+        cpu->cycles += (*ioReplay)[ioLog->size()].stall;
+    ioLog->push_back({address, data, true, (u16)(cpu->cycles - start)});
+}
+
+
+void Bus::writeDevice(u16 address, u8 data){
     if (address < 0x2000){
         mram[address & 0x07FF] = data;
     }
     else if (address < 0x4000){
-        // ppu registers mirrored every 8 bytes, only need the lsb
-        ppu->write(address & 0xF, data);
+        // ppu registers mirrored every 8 bytes
+        ppu->catchUp(cpu->cycles);
+        ppu->writeToRegisters(address & 0x7, data);
+    }
+    else if (address == 0x4014){
+        // OAM DMA, the CPU is halted for 513 cycles,
+        // plus one to line up on an odd cycle
+        u16 page = data << 8;
+        ppu->catchUp(cpu->cycles);
+        for (int i = 0; i < 0x100; i++)
+            ppu->writeOAM(read(page | i));
+        cpu->cycles += 513 + (cpu->cycles & 1);
     }
+    else if (address >= 0x6000){
+        // mapper registers live in PRG space, and can switch CHR
+        // or mirroring under the PPU, so it has to be up to date first
+        if (address >= 0x8000)
+            ppu->catchUp(cpu->cycles);
+
+        cart->write(address, data, cpu->cycles);
+
+        if (address >= 0x8000){
+            mapPrg();
+            cpu->prgBankSwitched();
+            ppu->chrBanksSwitched();
+        }
+    }
+
+    if (watchedPages[address >> 8])
+        notifyWatches(address, data);
+}
+
+
+// slow path for pages without a read pointer
+u8 Bus::readIO(u16 address){
+    if (!ioLog)
+        return readDevice(address);
+
+    u8 data = 0;
+    if (!ioReplay)
+        data = readDevice(address);
+    else if (ioLog->size() < ioReplay->size())
+        data = (*ioReplay)[ioLog->size()].value;
+    ioLog->push_back({address, data, false, 0});
+    return data;
 }
 
 
-u8 Bus::read(u16 address){
+u8 Bus::readDevice(u16 address){
     if (address < 0x2000){
         return mram[address & 0x07FF];
     }
     else if (address < 0x4000){
         // ppu registers mirrored every 8 bytes
-        ppu->read(address & 0x7);
+        ppu->catchUp(cpu->cycles);
+        return ppu->readFromRegisters(address & 0x7);
     }
     else if (address < 0x4020){
         // TODO: APU, I/O, and additional PPU registers
+        return 0;
     }
     else if (address < 0x6000){
         // Expansion ROM? idk
+        return 0;
     }
     else {
         return cart->read(address);
     }
 }
+
+
+void Bus::logIO(std::vector<IOAccess>* log, const std::vector<IOAccess>* replay){
+    ioLog = log;
+    ioReplay = replay;
+}
+
+
+bool Bus::IOAccess::operator==(const IOAccess& other) const {
+    return address == other.address && value == other.value
+        && write == other.write && stall == other.stall;
+}
+
+
+// the PPU's NMI output
+void Bus::triggerNMI(){
+    cpu->triggerNMI();
+}
+
+
+// PRG bank mapped at address, lets the CPU tell apart
+// code that runs at the same address from different banks
+u32 Bus::getPrgBank(u16 address){
+    return cart->getPrgBank(address);
+}
+
+
+int Bus::addWatch(u16 first, u16 last, WatchCallback callback){
+    Watch watch = {nextWatchId++, first, last, callback};
+    watches.push_back(watch);
+    markWatch(watch, 1);
+    return watch.id;
+}
+
+
+void Bus::removeWatch(int id){
+    for (auto it = watches.begin(); it != watches.end(); it++){
+        if (it->id == id){
+            markWatch(*it, -1);
+            watches.erase(it);
+            return;
+        }
+    }
+}
+
+
+// Counts a watch on every page it covers. Internal RAM repeats every
+// 2KB up to $1FFF, so a RAM page is watched through all of its mirrors
+void Bus::markWatch(const Watch& watch, int delta){
+    for (int page = watch.first >> 8; page <= (watch.last >> 8); page++){
+        if (page < 0x20){
+            for (int mirror = page & 0x07; mirror < 0x20; mirror += 0x08){
+                watchedPages[mirror] += delta;
+                mapPage(mirror);
+            }
+        }
+        else {
+            watchedPages[page] += delta;
+            mapPage(page);
+        }
+    }
+}
+
+
+// true if the watch covers address or one of its RAM mirrors
+bool Bus::watchCovers(const Watch& watch, u16 address){
+    if (address >= 0x2000)
+        return address >= watch.first && address <= watch.last;
+    for (u16 mirror = address & 0x07FF; mirror < 0x2000; mirror += 0x0800){
+        if (mirror >= watch.first && mirror <= watch.last)
+            return true;
+    }
+    return false;
+}
+
+
+// only reached for writes to a watched page
+void Bus::notifyWatches(u16 address, u8 data){
+    for (Watch& watch : watches){
+        if (watchCovers(watch, address))
+            watch.callback(address, data);
+    }
+}
@@ -1,6 +1,12 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <boost/format.hpp>
 
@@ -18,80 +24,361 @@ Cart::Cart(char* filepath, Logger& newLogger)
     logger << Logger::logType::LOG_INFO
         << msg
         << Logger::logType::LOG_ENDLINE;
-    std::ifstream rom(filepath);
-    getHeaderData(rom);
-    getRomData(rom);
-    getMapper();
+    // anything the board needs is allocated here, so a cart
+    // either loads completely or not at all
+    if (!mapFile(filepath) || !getHeaderData() || !getRomData() || !getMapper())
+        return;
+    getPrgRam(filepath);
+    printHeader();
+    loaded = true;
 }
 
 
 Cart::~Cart(){
-    
+    // the mapper's windows point into the image
+    mapper.reset();
+    if (image)
+        munmap(image, imageSize);
+}
+
+
+bool Cart::isLoaded(){
+    return loaded;
+}
+
+
+const RomHeader& Cart::getHeader(){
+    return header;
 }
 
 
-// reads from the cartridge
+// reads from the cartridge, the bus only
+// gets here for addresses it has no page pointer for
 u8 Cart::read(u16 address){
-    mapper->getMappedAddress(address);
-    return prgRom[address];
+    if (address < 0x6000)
+        return 0;
+    if (address < 0x8000){
+        if (!prgRam.size || !mapper->prgRamEnabled)
+            return 0;
+        return prgRam.data[(address - 0x6000) % prgRam.size];
+    }
+    return *mapper->prg(address);
+}
+
+
+// $6000-$7FFF is PRG RAM, writes above that land in mapper registers
+void Cart::write(u16 address, u8 data, u64 cycle){
+    if (address < 0x6000)
+        return;
+    if (address < 0x8000){
+        if (prgRam.size && mapper->prgRamWritable)
+            prgRam.data[(address - 0x6000) % prgRam.size] = data;
+    } else {
+        mapper->writeRegister(address, data, cycle);
+    }
+}
+
+
+// 8KB PRG ROM bank mapped at address
+u32 Cart::getPrgBank(u16 address){
+    return mapper->getPrgBank(address);
+}
+
+
+// Host memory backing a PRG address, the bus caches these per page.
+// PRG RAM smaller than a page can't be mirrored through a page pointer,
+// and disabled PRG RAM has to go through read() to read as open bus
+u8* Cart::getPrgPointer(u16 address){
+    if (address < 0x6000)
+        return nullptr;
+    if (address < 0x8000){
+        if (prgRam.size < 0x100 || !mapper->prgRamEnabled)
+            return nullptr;
+        return prgRam.data + (address - 0x6000) % prgRam.size;
+    }
+    return mapper->prg(address);
+}
+
+
+// false while the mapper has PRG RAM disabled or write protected
+bool Cart::isPrgRamWritable(){
+    return mapper->prgRamWritable;
+}
+
+
+// mappers can switch mirroring at runtime, the header only sets it up
+u8 Cart::getMirroring(){
+    return mapper->mirroring;
+}
+
+
+// the bus hands over the CPU's IRQ input for mappers that raise IRQs
+void Cart::connectIRQ(std::function<void(bool asserted)> irqLine){
+    mapper->irqLine = irqLine;
+}
+
+
+// lets the PPU skip A12 tracking for boards without a scanline counter
+bool Cart::countsScanlines(){
+    return mapper->countsScanlines;
 }
 
 
-void Cart::write(u16 address, u8 data){
-    mapper->getMappedAddress(address);
-    // TODO: writing support for on-cart RAM
-    // for now, do nothing
+void Cart::a12Rising(){
+    mapper->a12Rising();
+}
+
+
+int Cart::clocksUntilIrq(){
+    return mapper->clocksUntilIrq();
 }
 
 
 u8 Cart::readPPU(u16 address){
-    // kinda hacky temporary solution for getting nametables 
-    // to screen. Should be using Mapper for mapping addresses
-    return chrRom[address];
+    return *mapper->chr(address);
 }
 
 
+// CHR ROM ignores writes, CHR RAM flags the tile it wrote
 void Cart::writePPU(u16 address, u8 data){
-    // Probably not needed, but boilerplate here 
-    // just in case
-    // TODO: Figure out if I need this method
+    if (chrRam.empty())
+        return;
+    u8* target = mapper->chr(address);
+    *target = data;
+    u32 tile = (target - chrRam.data()) >> 4;
+    chrDirty[tile >> 6] |= 1ull << (tile & 63);
+}
+
+
+// host memory the mapper shows at a pattern table address
+const u8* Cart::getChrPointer(u16 address){
+    return mapper->chr(address);
 }
 
 
-// gets the header data from the rom stream
-void Cart::getHeaderData(std::ifstream &ifs){
-    char buffer[NES_HEADER_SIZE];
-    ifs.read(buffer, NES_HEADER_SIZE);
+bool Cart::hasChrRam(){
+    return !chrRam.empty();
+}
 
-    // read buffer into header vector
-    header = std::vector<u8>(NES_HEADER_SIZE);
-    for (int i = 0; i != NES_HEADER_SIZE; i++){
-        header[i] = buffer[i];
+
+// NES 2.0 ROM sizes are a count of units, unless the MSB nibble is $F
+// and the LSB packs an exponent and multiplier: 2^E * (MM * 2 + 1).
+// The exponent goes up to 63, sizes that don't fit in 32 bits are refused
+static bool romSize(u8 lsb, u8 msb, u32 unit, u32& size){
+    if (msb != 0x0F){
+        size = ((msb << 8) | lsb) * unit;
+        return true;
     }
+    u8 exponent = lsb >> 2;
+    if (exponent >= 32)
+        return false;
+    u64 bytes = (1ull << exponent) * ((lsb & 0x03) * 2 + 1);
+    if (bytes > UINT32_MAX)
+        return false;
+    size = bytes;
+    return true;
 }
 
 
-// Gets the mapperID from the header data & creates a pointer to the needed mapper
-void Cart::getMapper(){
-    u8 mapperID = (header[6] & 0xF0) >> 4 | (header[7] & 0xF0);
+// NES 2.0 RAM sizes are shift counts, 64 << n bytes or none at all
+static u32 ramSize(u8 shift){
+    return shift ? (64u << shift) : 0;
+}
 
-    switch (mapperID){
-        case 0: mapper = std::make_unique<Mapper000>(header[4], header[5]); break;
-        default: std::cout << "FUCK THAT ROM" << std::endl; break;
+
+// Fills in header from the first 16 bytes of a ROM image.
+// https://www.nesdev.org/wiki/NES_2.0
+bool parseHeader(const u8* data, RomHeader& header){
+    if (data[0] != 'N' || data[1] != 'E' || data[2] != 'S' || data[3] != 0x1A)
+        return false;
+
+    header = RomHeader();
+    header.nes20 = (data[7] & 0x0C) == 0x08;
+    header.mirroring = (data[6] & 0x01) ? VERTICAL_MIRROR : HORIZONTAL_MIRROR;
+    header.battery = data[6] & 0x02;
+    header.trainer = data[6] & 0x04;
+    header.fourScreen = data[6] & 0x08;
+    header.mapper = (data[6] >> 4) | (data[7] & 0xF0);
+
+    if (header.nes20){
+        header.mapper |= (data[8] & 0x0F) << 8;
+        header.submapper = data[8] >> 4;
+        if (!romSize(data[4], data[9] & 0x0F, 0x4000, header.prgRomSize)
+            || !romSize(data[5], data[9] >> 4, 0x2000, header.chrRomSize))
+            return false;
+        header.prgRamSize = ramSize(data[10] & 0x0F);
+        header.prgNvramSize = ramSize(data[10] >> 4);
+        header.chrRamSize = ramSize(data[11] & 0x0F);
+        header.chrNvramSize = ramSize(data[11] >> 4);
+        header.timing = data[12] & 0x03;
+        return true;
+    }
+
+    // Old dumping tools left junk in bytes 12-15,
+    // in which case byte 7 can't be trusted either
+    if (data[12] || data[13] || data[14] || data[15])
+        header.mapper &= 0x0F;
+
+    // iNES 1.0 has no RAM sizes, assume the usual 8KB
+    header.prgRomSize = data[4] * 0x4000;
+    header.chrRomSize = data[5] * 0x2000;
+    u32 prgRam = data[8] ? data[8] * 0x2000 : 0x2000;
+    if (header.battery)
+        header.prgNvramSize = prgRam;
+    else
+        header.prgRamSize = prgRam;
+    header.chrRamSize = header.chrRomSize ? 0 : 0x2000;
+    header.timing = (data[9] & 0x01) ? TIMING_PAL : TIMING_NTSC;
+    return true;
+}
+
+
+// Maps the ROM file read-only. PRG and CHR ROM are used in place, so
+// loading costs the same for any size and every instance running the
+// same ROM shares one copy in the page cache
+bool Cart::mapFile(const char* filepath){
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0){
+        logger << Logger::logType::LOG_ERROR
+            << "Could not open ROM file"
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    struct stat info;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size >= NES_HEADER_SIZE)
+        mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // the mapping holds its own reference to the file
+    close(fd);
+    if (mapping == MAP_FAILED){
+        logger << Logger::logType::LOG_ERROR
+            << "Could not map ROM file"
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    image = (u8*)mapping;
+    imageSize = info.st_size;
+    return true;
+}
+
+
+// gets the header data from the start of the image
+bool Cart::getHeaderData(){
+    if (!parseHeader(image, header)){
+        logger << Logger::logType::LOG_ERROR
+            << "Not an iNES/NES 2.0 ROM, or its ROM sizes are out of range"
+            << Logger::logType::LOG_ENDLINE;
+        return false;
     }
+    return true;
 }
 
 
-// gets prgRom, chrRom, etc.. from the rom stream
-void Cart::getRomData(std::ifstream &ifs){
-    mirroring = (header[6] & 0x01) ? VERTICAL_MIRROR : HORIZONTAL_MIRROR;
-    if (header[6] & 0x04) ifs.seekg(512, std::ios_base::cur);
+// Creates the mapper the header asks for. Unsupported boards
+// are refused here rather than failing on their first access
+bool Cart::getMapper(){
+    mapper = createMapper(header.mapper, prgRom, chrRom);
+    if (!mapper){
+        boost::format fmt = boost::format("Unsupported mapper %d (submapper %d)")
+            % header.mapper % (int)header.submapper;
+        logger << Logger::logType::LOG_ERROR
+            << fmt.str()
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    // mappers with a mirroring control take over on their first write
+    mapper->mirroring = header.mirroring;
+    return true;
+}
 
-    prgRomSize = header[4] * 16384;
-    prgRom.resize(prgRomSize);
-    ifs.read((char*)prgRom.data(), prgRom.size());
 
-    chrRomSize = header[5] * 8192;
-    chrRom.resize(chrRomSize);
-    ifs.read((char*)chrRom.data(), chrRom.size());
-}
\ No newline at end of file
+// points prgRom, chrRom, etc.. into the image
+bool Cart::getRomData(){
+    size_t offset = NES_HEADER_SIZE + (header.trainer ? NES_TRAINER_SIZE : 0);
+    size_t end = offset + header.prgRomSize + header.chrRomSize;
+    if (end > imageSize){
+        logger << Logger::logType::LOG_ERROR
+            << "ROM file is shorter than its header says"
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    // the mappers bank in 8KB PRG and 1KB CHR windows,
+    // anything smaller would leave a window hanging off the end
+    if (header.prgRomSize < PRG_WINDOW_SIZE
+        || (header.chrRomSize && header.chrRomSize < CHR_WINDOW_SIZE)){
+        boost::format fmt = boost::format("ROM too small to bank: %d bytes PRG, %d bytes CHR")
+            % header.prgRomSize % header.chrRomSize;
+        logger << Logger::logType::LOG_ERROR
+            << fmt.str()
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    prgRom.data = image + offset;
+    prgRom.size = header.prgRomSize;
+
+    // boards without CHR ROM get whatever CHR RAM the header asks for
+    if (header.chrRomSize){
+        chrRom.data = image + offset + header.prgRomSize;
+        chrRom.size = header.chrRomSize;
+    } else {
+        // NES 2.0 can ask for as little as 128 bytes, the windows
+        // still need a full 8KB behind them to stay mapped
+        chrRam.resize(std::max<u32>(header.chrRamSize + header.chrNvramSize, 0x2000));
+        chrRom.data = chrRam.data();
+        chrRom.size = chrRam.size();
+    }
+
+    // nothing has been decoded yet, so every tile starts out dirty
+    chrDirty.assign((chrRam.size() + 0x3FF) >> 10, ~0ull);
+    return true;
+}
+
+
+// Battery backed boards keep their PRG RAM in a .sav file next to the
+// ROM. Boards with both kinds of PRG RAM keep all of it in the file.
+// If the file can't be used the game still runs, it just won't save
+void Cart::getPrgRam(const std::string& filepath){
+    u32 size = header.prgRamSize + header.prgNvramSize;
+    if (size == 0)
+        return;
+
+    if (header.battery){
+        size_t dot = filepath.find_last_of('.');
+        size_t slash = filepath.find_last_of('/');
+        bool extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+        std::string savePath = (extension ? filepath.substr(0, dot) : filepath) + ".sav";
+        saveRam = std::make_unique<SaveRam>(logger);
+        if (saveRam->open(savePath, size)){
+            prgRam.data = saveRam->getData();
+            prgRam.size = size;
+            return;
+        }
+        saveRam.reset();
+    }
+
+    prgRamStorage.resize(size);
+    prgRam.data = prgRamStorage.data();
+    prgRam.size = size;
+}
+
+
+void Cart::printHeader(){
+    static const char* const timings[4] = {"NTSC", "PAL", "multi-region", "Dendy"};
+    boost::format fmt = boost::format(
+        "%s mapper %d.%d, PRG ROM %dKB, CHR ROM %dKB, PRG RAM %dKB%s, CHR RAM %dKB, %s")
+        % (header.nes20 ? "NES 2.0" : "iNES") % header.mapper % (int)header.submapper
+        % (header.prgRomSize / 1024) % (header.chrRomSize / 1024)
+        % ((header.prgRamSize + header.prgNvramSize) / 1024)
+        % (header.battery ? " (battery)" : "")
+        % ((header.chrRamSize + header.chrNvramSize) / 1024)
+        % timings[header.timing];
+    logger << Logger::logType::LOG_INFO
+        << fmt.str()
+        << Logger::logType::LOG_ENDLINE;
+}
@@ -171,6 +171,16 @@ void GUI::MainMenuBar(System* sys){
             if (ImGui::MenuItem("Load Rom")){
                 sys->loadCart();
             }
+            if (ImGui::BeginMenu("Roms", !sys->getLibrary().empty())){
+                for (const LibraryEntry& entry : sys->getLibrary()){
+                    if (!entry.valid)
+                        continue;
+                    std::string name = entry.path.substr(entry.path.find_last_of('/') + 1);
+                    if (ImGui::MenuItem(name.c_str()))
+                        sys->loadCart((char*)entry.path.c_str());
+                }
+                ImGui::EndMenu();
+            }
             if (ImGui::BeginMenu("Save")){
                 if (ImGui::MenuItem("State 1")){
                     // TODO: save state 1 callback function
@@ -223,6 +233,22 @@ void GUI::CPUDebugWindow(CPU &cpu){
         ImGui::Text("02h: %x", cpu.error1);
         ImGui::Text("03h: %x", cpu.error2);
         if (ImGui::Button("Step CPU")) cpu.tick();
+
+        ImGui::Separator();
+        CPU::Backend backend = cpu.getBackend();
+        if (ImGui::RadioButton("Interpreter", backend == CPU::Backend::INTERPRETER))
+            cpu.setBackend(CPU::Backend::INTERPRETER);
+        ImGui::SameLine();
+        if (ImGui::RadioButton("Block cache", backend == CPU::Backend::BLOCK_CACHE))
+            cpu.setBackend(CPU::Backend::BLOCK_CACHE);
+        ImGui::SameLine();
+        if (ImGui::RadioButton("Recompiler", backend == CPU::Backend::RECOMPILER))
+            cpu.setBackend(CPU::Backend::RECOMPILER);
+        ImGui::SameLine();
+        if (ImGui::RadioButton("Validate", backend == CPU::Backend::VALIDATE))
+            cpu.setBackend(CPU::Backend::VALIDATE);
+        ImGui::Text("Blocks compiled: %llu", (unsigned long long) cpu.blocksCompiled);
+        ImGui::Text("Blocks invalidated: %llu", (unsigned long long) cpu.blocksInvalidated);
     }
     ImGui::End();
 }
@@ -231,8 +257,10 @@ void GUI::CPUDebugWindow(CPU &cpu){
 void GUI::PpuDebugWindow(PPU &ppu){
     ImGui::Begin("PPU Debug Window", &show_debug_window);
     {
-        ImGui::Image((ImTextureID)(ppu.renderNT1()), ImVec2(80 * 2.f, 72 * 2.f));
-        ImGui::Image((ImTextureID)(ppu.renderNT2()), ImVec2(80 * 2.f, 72 * 2.f));
+        ImGui::Image((ImTextureID)(intptr_t)ppu.renderFrame(), ImVec2(FRAME_WIDTH * 2.f, FRAME_HEIGHT * 2.f));
+        ImGui::Text("Fast lines = %llu", (unsigned long long)ppu.fastLines);
+        ImGui::Text("Dot lines = %llu", (unsigned long long)ppu.accurateLines);
+        ImGui::Checkbox("Dot accurate only", &ppu.accurateOnly);
     }
     ImGui::End();
     
@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+#include <boost/format.hpp>
+#include <boost/uuid/detail/sha1.hpp>
+
+#include "../include/library.h"
+
+
+Library::Library(Logger& newLogger, const std::string& newIndexPath)
+    : logger(newLogger), indexPath(newIndexPath)
+{
+    loadIndex();
+}
+
+
+const std::vector<LibraryEntry>& Library::getEntries(){
+    return entries;
+}
+
+
+// .nes files anywhere under path, with the stat info the index uses to
+// tell whether they changed. Symlinks are followed, so directories are
+// remembered by device and inode to walk each one only once
+typedef std::set<std::pair<dev_t, ino_t>> VisitedDirectories;
+
+static void findRoms(const std::string& path, std::vector<LibraryEntry>& found, VisitedDirectories& visited){
+    struct stat self;
+    if (stat(path.c_str(), &self) != 0 || !visited.insert({self.st_dev, self.st_ino}).second)
+        return;
+
+    DIR* dir = opendir(path.c_str());
+    if (!dir)
+        return;
+
+    while (dirent* item = readdir(dir)){
+        std::string name = item->d_name;
+        if (name == "." || name == "..")
+            continue;
+
+        std::string full = path + "/" + name;
+        struct stat info;
+        if (stat(full.c_str(), &info) != 0)
+            continue;
+
+        if (S_ISDIR(info.st_mode)){
+            findRoms(full, found, visited);
+            continue;
+        }
+
+        std::string extension = name.size() > 4 ? name.substr(name.size() - 4) : "";
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (!S_ISREG(info.st_mode) || extension != ".nes")
+            continue;
+
+        LibraryEntry entry;
+        entry.path = full;
+        entry.mtime = (s64)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+        entry.size = info.st_size;
+        found.push_back(entry);
+    }
+    closedir(dir);
+}
+
+
+// Walks the directories, reuses every indexed entry whose file is
+// unchanged and hashes the rest on worker threads. Entries under the
+// scanned directories are replaced by what this scan found, entries
+// from directories that weren't scanned this time are kept
+void Library::scan(const std::vector<std::string>& directories, unsigned threads){
+    std::vector<LibraryEntry> found;
+    VisitedDirectories visited;
+    for (const std::string& directory : directories)
+        findRoms(directory, found, visited);
+
+    std::unordered_map<std::string, const LibraryEntry*> indexed;
+    for (const LibraryEntry& entry : entries)
+        indexed[entry.path] = &entry;
+
+    std::vector<LibraryEntry*> stale;
+    filesReused = 0;
+    for (LibraryEntry& entry : found){
+        auto known = indexed.find(entry.path);
+        if (known != indexed.end() && known->second->mtime == entry.mtime && known->second->size == entry.size){
+            entry = *known->second;
+            filesReused++;
+        } else {
+            stale.push_back(&entry);
+        }
+    }
+
+    // workers claim files off a shared counter, each
+    // one only ever writes the entry it claimed
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, stale.size());
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++){
+        workers.emplace_back([&](){
+            for (size_t job = next++; job < stale.size(); job = next++)
+                hashFile(*stale[job]);
+        });
+    }
+    for (std::thread& worker : workers)
+        worker.join();
+    filesHashed = stale.size();
+
+    // findRoms builds every path as directory + "/" + name
+    for (const LibraryEntry& entry : entries){
+        bool scanned = false;
+        for (const std::string& directory : directories)
+            scanned |= entry.path.compare(0, directory.size() + 1, directory + "/") == 0;
+        if (!scanned)
+            found.push_back(entry);
+    }
+
+    std::sort(found.begin(), found.end(), [](const LibraryEntry& a, const LibraryEntry& b){
+        return a.path < b.path;
+    });
+    entries = std::move(found);
+    saveIndex();
+
+    boost::format fmt = boost::format("Library scan: %d ROMs, %d hashed, %d unchanged")
+        % entries.size() % filesHashed % filesReused;
+    logger << Logger::logType::LOG_INFO
+        << fmt.str()
+        << Logger::logType::LOG_ENDLINE;
+}
+
+
+// Runs on a worker thread, so it must not touch anything but entry.
+// The file is mapped rather than read, same as when a cart loads it
+void Library::hashFile(LibraryEntry& entry){
+    entry.valid = false;
+    int fd = open(entry.path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    void* mapping = MAP_FAILED;
+    if (entry.size >= NES_HEADER_SIZE)
+        mapping = mmap(nullptr, entry.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return;
+
+    const u8* image = (const u8*)mapping;
+    if (parseHeader(image, entry.header)){
+        size_t offset = NES_HEADER_SIZE + (entry.header.trainer ? NES_TRAINER_SIZE : 0);
+        size_t length = entry.header.prgRomSize + entry.header.chrRomSize;
+        entry.valid = offset + length <= entry.size;
+        if (entry.valid){
+            boost::crc_32_type crc;
+            crc.process_bytes(image + offset, length);
+            entry.crc32 = crc.checksum();
+
+            boost::uuids::detail::sha1 sha1;
+            sha1.process_bytes(image + offset, length);
+            boost::uuids::detail::sha1::digest_type digest;
+            sha1.get_digest(digest);
+
+            // boost has used both 5 words and 20 bytes for the digest
+            std::ostringstream hex;
+            for (auto part : digest)
+                hex << std::hex << std::setfill('0') << std::setw(sizeof(part) * 2) << (u32)part;
+            entry.sha1 = hex.str();
+        }
+    }
+    munmap(mapping, entry.size);
+}
+
+
+///////////////////////////////////////////////
+// Index File                                //
+///////////////////////////////////////////////
+
+
+// One line per ROM, tab separated:
+// path mtime size valid crc32 sha1 nes20 mapper submapper prgRom chrRom
+// prgRam prgNvram chrRam chrNvram mirroring fourScreen battery trainer timing
+bool Library::loadIndex(){
+    std::ifstream index(indexPath);
+    if (!index.is_open())
+        return false;
+
+    int version = 0;
+    std::string magic;
+    index >> magic >> version;
+    if (magic != "NESLIB" || version != LIBRARY_INDEX_VERSION){
+        logger << Logger::logType::LOG_WARNING
+            << "Ignoring library index from another version"
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    std::string line;
+    std::getline(index, line);
+    while (std::getline(index, line)){
+        std::istringstream fields(line);
+        LibraryEntry entry;
+        RomHeader& header = entry.header;
+        int valid, nes20, mirroring, fourScreen, battery, trainer, timing, submapper;
+        std::getline(fields, entry.path, '\t');
+        fields >> entry.mtime >> entry.size >> valid >> std::hex >> entry.crc32 >> std::dec
+            >> entry.sha1 >> nes20 >> header.mapper >> submapper
+            >> header.prgRomSize >> header.chrRomSize
+            >> header.prgRamSize >> header.prgNvramSize
+            >> header.chrRamSize >> header.chrNvramSize
+            >> mirroring >> fourScreen >> battery >> trainer >> timing;
+        if (!fields)
+            continue;
+
+        if (entry.sha1 == "-")
+            entry.sha1.clear();
+        entry.valid = valid;
+        header.nes20 = nes20;
+        header.submapper = submapper;
+        header.mirroring = mirroring;
+        header.fourScreen = fourScreen;
+        header.battery = battery;
+        header.trainer = trainer;
+        header.timing = timing;
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+
+// Written to a temporary file and synced before the rename,
+// so a crash never leaves a truncated index behind
+bool Library::saveIndex(){
+    std::string temporary = indexPath + ".tmp";
+    std::ofstream index(temporary);
+    if (!index.is_open()){
+        logger << Logger::logType::LOG_WARNING
+            << "Could not write library index"
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    index << "NESLIB " << LIBRARY_INDEX_VERSION << "\n";
+    for (const LibraryEntry& entry : entries){
+        const RomHeader& header = entry.header;
+        index << entry.path << '\t' << entry.mtime << ' ' << entry.size << ' ' << entry.valid << ' '
+            << std::hex << entry.crc32 << std::dec << ' '
+            << (entry.sha1.empty() ? "-" : entry.sha1) << ' '
+            << header.nes20 << ' ' << header.mapper << ' ' << (int)header.submapper << ' '
+            << header.prgRomSize << ' ' << header.chrRomSize << ' '
+            << header.prgRamSize << ' ' << header.prgNvramSize << ' '
+            << header.chrRamSize << ' ' << header.chrNvramSize << ' '
+            << (int)header.mirroring << ' ' << header.fourScreen << ' '
+            << header.battery << ' ' << header.trainer << ' ' << (int)header.timing << "\n";
+    }
+    index.flush();
+    bool written = index.good();
+    index.close();
+
+    // ofstream can't fsync, so the data goes down through a second descriptor
+    int fd = open(temporary.c_str(), O_RDONLY);
+    written = written && fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+
+    if (!written){
+        logger << Logger::logType::LOG_WARNING
+            << "Could not write library index"
+            << Logger::logType::LOG_ENDLINE;
+        unlink(temporary.c_str());
+        return false;
+    }
+    return rename(temporary.c_str(), indexPath.c_str()) == 0;
+}
@@ -1,5 +1,8 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
 
 #include "../include/system.h"
 #include "../include/log.h"
@@ -14,18 +17,45 @@ int printUsage(){
     "\n"
     "These are the flags:\n"
     "   --demo, -d              enables ImGui demo window\n"
+    "   --trace, -l             logs every executed instruction\n"
+    "   --trace-frames F:L      only logs instructions in frames F to L\n"
+    "   --trace-pc FROM:TO      only logs instructions with PC in FROM to TO (hex)\n"
+    "   --library, -L <dir>     indexes the ROMs under <dir> for the Library menu\n"
     "   --help, -h              shows this message!\n";
     return 1;
 }
 
 
+// parses "first:last" with both numbers in the given base
+bool parseRange(const char* text, int base, u64& first, u64& last){
+    char* end;
+    first = strtoull(text, &end, base);
+    if (end == text || *end != ':')
+        return false;
+    const char* second = end + 1;
+    last = strtoull(second, &end, base);
+    return end != second && *end == '\0' && first <= last;
+}
+
+
 int main(int argc, char *argv[]){
 
     std::unique_ptr<Logger> logger = std::make_unique<Logger>();
     System nes("NES", *logger);
 
-    if(argc == 2){ 
-        std::string argument = argv[1];
+    // the two trace ranges combine, either one alone turns tracing on
+    bool tracing = false;
+    u64 traceFirstFrame = 0;
+    u64 traceLastFrame = UINT64_MAX;
+
+    // every -L adds to one scan
+    std::vector<std::string> libraryDirectories;
+
+    for (int i = 1; i < argc; i++){
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        u64 first, last;
+
         if (argument == "--demo" || argument == "-d"){
             *logger << Logger::logType::LOG_INFO
                 << "ImGui demo mode set"
@@ -38,17 +68,41 @@ int main(int argc, char *argv[]){
                 << Logger::logType::LOG_ENDLINE;
             nes.setTesting(true);
         }
-        else if (argument == "--help" || argument == "-h"){
-            return printUsage();
+        else if (argument == "--trace" || argument == "-l"){
+            tracing = true;
+        }
+        else if (argument == "--trace-frames" && hasValue){
+            if (!parseRange(argv[++i], 10, first, last))
+                return printUsage();
+            tracing = true;
+            traceFirstFrame = first;
+            traceLastFrame = last;
+        }
+        else if (argument == "--trace-pc" && hasValue){
+            if (!parseRange(argv[++i], 16, first, last) || last > 0xFFFF)
+                return printUsage();
+            tracing = true;
+            nes.setTraceRange(first, last);
+        }
+        else if ((argument == "--library" || argument == "-L") && hasValue){
+            libraryDirectories.push_back(argv[++i]);
         }
         else{
+            // --help, -h and anything unknown
             return printUsage();
         }
     }
-    else if(argc > 2) {
-        return printUsage();
+
+    if (tracing){
+        *logger << Logger::logType::LOG_INFO
+            << "Instruction tracing enabled"
+            << Logger::logType::LOG_ENDLINE;
+        nes.setTraceFrames(traceFirstFrame, traceLastFrame);
     }
 
+    if (!libraryDirectories.empty())
+        nes.scanLibrary(libraryDirectories);
+
     // enter the main emulation loop
     return nes.mainLoop();
 
@@ -1,23 +1,271 @@
 #include "../include/mappers.h"
 
 
-BasicMapper::BasicMapper(u8 &_numPrgBanks, u8 &_numChrBanks)
-    : numPrgBanks(_numPrgBanks), numChrBanks(_numChrBanks){}
+BasicMapper::BasicMapper(CartMemory prgMemory, CartMemory chrMemory)
+    : prgRom(prgMemory), chrRom(chrMemory)
+    , numPrgBanks(prgMemory.size / PRG_WINDOW_SIZE)
+    , numChrBanks(chrMemory.size / CHR_WINDOW_SIZE){}
+
+
+// points an 8KB PRG window at a bank of PRG ROM
+void BasicMapper::mapPrg(int window, u32 bank){
+    if (numPrgBanks == 0)
+        return;
+    bank %= numPrgBanks;
+    prgBanks[window] = bank;
+    prgWindows[window] = prgRom.data + bank * PRG_WINDOW_SIZE;
+}
+
+
+// points a 1KB CHR window at a bank of CHR memory
+void BasicMapper::mapChr(int window, u32 bank){
+    if (numChrBanks == 0)
+        return;
+    bank %= numChrBanks;
+    chrWindows[window] = chrRom.data + bank * CHR_WINDOW_SIZE;
+}
+
+
+void BasicMapper::mapPrg16K(int slot, u32 bank){
+    mapPrg(slot * 2, bank * 2);
+    mapPrg(slot * 2 + 1, bank * 2 + 1);
+}
+
+
+void BasicMapper::mapPrg32K(u32 bank){
+    for (int i = 0; i < 4; i++)
+        mapPrg(i, bank * 4 + i);
+}
+
+
+void BasicMapper::mapChr4K(int slot, u32 bank){
+    for (int i = 0; i < 4; i++)
+        mapChr(slot * 4 + i, bank * 4 + i);
+}
+
+
+void BasicMapper::mapChr8K(u32 bank){
+    for (int i = 0; i < 8; i++)
+        mapChr(i, bank * 8 + i);
+}
+
+
+/* Mapper registry */
+
+
+// function local so registrations from other static
+// initialisers never see it unconstructed
+std::unordered_map<u16, MapperFactory>& mapperRegistry(){
+    static std::unordered_map<u16, MapperFactory> registry;
+    return registry;
+}
+
+
+std::unique_ptr<BasicMapper> createMapper(u16 number, CartMemory prgMemory, CartMemory chrMemory){
+    auto factory = mapperRegistry().find(number);
+    if (factory == mapperRegistry().end())
+        return nullptr;
+    return factory->second(prgMemory, chrMemory);
+}
+
+
+/* Discrete logic boards */
+
+
+REGISTER_MAPPER(2, Mapper002)
+REGISTER_MAPPER(3, Mapper003)
+REGISTER_MAPPER(7, Mapper007)
+REGISTER_MAPPER(11, Mapper011)
+REGISTER_MAPPER(66, Mapper066)
 
 
 /* Mapper 000 */
 
 
-Mapper000::Mapper000(u8 &_numPrgBanks, u8 &_numChrBanks)
-    : BasicMapper(_numPrgBanks, _numPrgBanks){}
+// NROM has no registers, 16KB boards mirror their only bank at $C000
+Mapper000::Mapper000(CartMemory prgMemory, CartMemory chrMemory)
+    : BasicMapper(prgMemory, chrMemory)
+{
+    mapPrg32K(0);
+    mapChr8K(0);
+}
+
+REGISTER_MAPPER(0, Mapper000)
+
+
+/* Mapper 001 */
+
+
+// MMC1 powers up with the last PRG bank fixed at $C000. Mirroring
+// is left alone until the game writes the control register
+Mapper001::Mapper001(CartMemory prgMemory, CartMemory chrMemory)
+    : BasicMapper(prgMemory, chrMemory)
+{
+    mapPrg16K(0, 0);
+    mapPrg16K(1, numPrgBanks / 2 - 1);
+    mapChr8K(0);
+}
+
+REGISTER_MAPPER(1, Mapper001)
+
+
+// Registers are loaded one bit per write through a 5 bit shift register.
+// Only the 5th write touches the banks, writes with bit 7 set reset it
+void Mapper001::writeRegister(u16 address, u8 data, u64 cycle){
+    // MMC1 ignores a write on the cycle right after the previous one,
+    // which is how read-modify-write instructions hit it. The CPU stamps
+    // both writes of an RMW instruction with the same cycle count
+    bool consecutive = (cycle == lastWriteCycle);
+    lastWriteCycle = cycle;
+    if (consecutive)
+        return;
+
+    if (data & 0x80){
+        shift = 0x10;
+        control |= 0x0C;
+        updateBanks();
+        return;
+    }
+
+    bool full = shift & 0x01;
+    shift = (shift >> 1) | ((data & 0x01) << 4);
+    if (!full)
+        return;
+
+    // register is picked by address bits 13 and 14
+    switch ((address >> 13) & 0x3){
+        case 0: control = shift; break;
+        case 1: chrBank0 = shift; break;
+        case 2: chrBank1 = shift; break;
+        case 3: prgBank = shift; break;
+    }
+    shift = 0x10;
+    updateBanks();
+}
+
 
+void Mapper001::updateBanks(){
+    // MMC1 numbers its mirroring modes in a different order
+    static const u8 mirroringModes[4] = {
+        SINGLE_SCREEN_LOWER, SINGLE_SCREEN_UPPER, VERTICAL_MIRROR, HORIZONTAL_MIRROR
+    };
+    mirroring = mirroringModes[control & 0x03];
 
-u16 Mapper000::getMappedAddress(u16 &address){
-    if (numPrgBanks > 1){
-        // Masking w/ 7FFF removes 15th bit: drops 8000 to 0
-        address = address & 0x7FFF;
+    // PRG: 32KB switch, or fix the first or last 16KB bank
+    u8 bank = prgBank & 0x0F;
+    switch ((control >> 2) & 0x03){
+        case 0: case 1: mapPrg32K(bank >> 1); break;
+        case 2: mapPrg16K(0, 0); mapPrg16K(1, bank); break;
+        case 3: mapPrg16K(0, bank); mapPrg16K(1, numPrgBanks / 2 - 1); break;
+    }
+
+    // CHR: one 8KB bank or two independent 4KB banks
+    if (control & 0x10){
+        mapChr4K(0, chrBank0);
+        mapChr4K(1, chrBank1);
     } else {
-        // Masking w/ 3FFF mirrors bank 1: C000-FFFF effectively mirrors 8000-BFFF
-        address = address & 0x3FFF;
+        mapChr8K(chrBank0 >> 1);
     }
 }
+
+
+/* Mapper 004 */
+
+
+Mapper004::Mapper004(CartMemory prgMemory, CartMemory chrMemory)
+    : BasicMapper(prgMemory, chrMemory)
+{
+    countsScanlines = true;
+    updateBanks();
+}
+
+REGISTER_MAPPER(4, Mapper004)
+
+
+// Registers come in even/odd pairs, selected by
+// address bits 13-14 and bit 0
+void Mapper004::writeRegister(u16 address, u8 data, u64 cycle){
+    bool odd = address & 0x01;
+    switch ((address >> 13) & 0x3){
+        case 0:
+            if (odd)
+                banks[bankSelect & 0x07] = data;
+            else
+                bankSelect = data;
+            updateBanks();
+            break;
+        case 1:
+            // $A001: bit 7 enables PRG RAM, bit 6 write protects it
+            if (odd){
+                prgRamEnabled = data & 0x80;
+                prgRamWritable = (data & 0xC0) == 0x80;
+            } else {
+                mirroring = (data & 0x01) ? HORIZONTAL_MIRROR : VERTICAL_MIRROR;
+            }
+            break;
+        case 2:
+            if (odd)
+                irqReload = true;
+            else
+                irqLatch = data;
+            break;
+        case 3:
+            // disabling also acknowledges a pending IRQ
+            irqEnabled = odd;
+            if (!odd && irqLine)
+                irqLine(false);
+            break;
+    }
+}
+
+
+// Clocked once per scanline while rendering, the IRQ
+// fires when the counter reaches zero
+void Mapper004::a12Rising(){
+    if (irqCounter == 0 || irqReload){
+        irqCounter = irqLatch;
+        irqReload = false;
+    } else {
+        irqCounter--;
+    }
+
+    if (irqCounter == 0 && irqEnabled && irqLine)
+        irqLine(true);
+}
+
+
+int Mapper004::clocksUntilIrq(){
+    if (!irqEnabled)
+        return -1;
+    // a reload takes a clock of its own
+    if (irqCounter == 0 || irqReload)
+        return irqLatch + 1;
+    return irqCounter;
+}
+
+
+void Mapper004::updateBanks(){
+    // PRG: R6/R7 are switchable, the second to last bank sits
+    // at either $8000 or $C000 and the last bank is always fixed
+    u32 secondLast = numPrgBanks - 2;
+    if (bankSelect & 0x40){
+        mapPrg(0, secondLast);
+        mapPrg(2, banks[6]);
+    } else {
+        mapPrg(0, banks[6]);
+        mapPrg(2, secondLast);
+    }
+    mapPrg(1, banks[7]);
+    mapPrg(3, numPrgBanks - 1);
+
+    // CHR: R0/R1 are 2KB banks, R2-R5 1KB banks,
+    // bit 7 swaps which half of the pattern tables they cover
+    int base = (bankSelect & 0x80) ? 4 : 0;
+    mapChr(base + 0, banks[0] & 0xFE);
+    mapChr(base + 1, banks[0] | 0x01);
+    mapChr(base + 2, banks[1] & 0xFE);
+    mapChr(base + 3, banks[1] | 0x01);
+    base ^= 4;
+    for (int i = 0; i < 4; i++)
+        mapChr(base + i, banks[2 + i]);
+}
@@ -1,14 +1,48 @@
 #include "../include/ppu.h"
 #include "../include/bus.h"
 
+#include <algorithm>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+// MMC3 ignores A12 rising unless it was low for about 3 CPU cycles
+#define A12_FILTER_DOTS 10
+
+// After the background fetches, A12 can only rise on the low plane
+// fetch of a sprite slot, 8 dots apart, or of the next line's first tile
+#define A12_SPRITE_RISE_DOT 261
+#define A12_BACKGROUND_RISE_DOT 325
+
+
+// flags on top of a sprite pixel's palette << 2 | pixel
+#define SPRITE_BEHIND 0x20
+#define SPRITE_ZERO 0x40
+
+// outside pattern space, for sprite slots without a pending low plane
+#define NO_SPRITE_ROW 0xFFFF
+
+
+// Physical nametable behind $2000/$2400/$2800/$2C00
+// for each mirroring mode
+static const u8 nametableLayout[4][4] = {
+    {0, 0, 1, 1},   // HORIZONTAL_MIRROR
+    {0, 1, 0, 1},   // VERTICAL_MIRROR
+    {0, 0, 0, 0},   // SINGLE_SCREEN_LOWER
+    {1, 1, 1, 1},   // SINGLE_SCREEN_UPPER
+};
+
 
 // constructor
 PPU::PPU(Bus& newBus, Logger& newLogger)
     : bus(&newBus), logger(newLogger)
 {
     bus->connectPPU(*this);
-    initTexture(NT1_id);
-    initTexture(NT2_id);
+    std::fill(spriteRowAddress, spriteRowAddress + 8, NO_SPRITE_ROW);
+    initTexture(frameTexture);
 }
 
 
@@ -17,50 +51,62 @@ PPU::~PPU(){};
 
 void PPU::connectCart(Cart& newCart){
     cart = &newCart;
+    scanlineCounter = cart->countsScanlines();
+    tileCache.connectCart(newCart);
+    tilesStale = true;
 }
 
 
+///////////////////////////////////////////////
+// Registers                                 //
+///////////////////////////////////////////////
+
+
 // writing to registers
 void PPU::writeToRegisters(u8 reg, u8 value){
+    openBus = value;
     switch (reg){
         case 0:
+            // enabling NMI during vblank fires one straight away
+            if (!(PPUCTRL & 0x80) && (value & 0x80) && (PPUSTATUS & 0x80))
+                bus->triggerNMI();
             PPUCTRL = value;
+            TRAMADDR = (TRAMADDR & 0xF3FF) | ((value & 0x03) << 10);
             break;
-        case 1: ;
+        case 1:
             PPUMASK = value;
             break;
         case 2:
-            // PPUSTATUS is read only 
+            // PPUSTATUS is read only
             break;
         case 3:
             OAMADDR = value;
             break;
-        case 4: 
-            OAMDATA = value;
-            OAMADDR += 1;
+        case 4:
+            writeOAM(value);
             break;
         case 5:
-            // TODO: implement writing to PPUSCROLL
-            if (addressLatch) {
-                break;
+            if (!addressLatch){
+                fineX = value & 0x07;
+                TRAMADDR = (TRAMADDR & 0xFFE0) | (value >> 3);
             } else {
-                break;
+                TRAMADDR = (TRAMADDR & 0x8C1F) | ((value & 0x07) << 12) | ((value & 0xF8) << 2);
             }
+            addressLatch = !addressLatch;
+            break;
         case 6:
-            if (addressLatch == 0) {
-                TRAMADDR = ((value & 0x3F) << 8) | 0x00FF;
-                addressLatch = 1;
-                break;
+            if (!addressLatch){
+                TRAMADDR = (TRAMADDR & 0x00FF) | ((value & 0x3F) << 8);
             } else {
                 TRAMADDR = (TRAMADDR & 0xFF00) | value;
                 VRAMADDR = TRAMADDR;
-                addressLatch = 0;
-                break;
+                updateA12(VRAMADDR);
             }
+            addressLatch = !addressLatch;
+            break;
         case 7:
             write(VRAMADDR, value);
-            u8 offset = (PPUCTRL & 0b100) ? 1 : 32;
-            VRAMADDR += offset;
+            VRAMADDR = (VRAMADDR + ((PPUCTRL & 0x04) ? 32 : 1)) & 0x7FFF;
             break;
     }
 }
@@ -68,122 +114,806 @@ void PPU::writeToRegisters(u8 reg, u8 value){
 
 // Reading from Registers
 u8 PPU::readFromRegisters(u8 reg){
-
-    u8 data;
+    u8 data = openBus;
     switch (reg){
-        case 0:
-            // PPUCTRL is write only
-            break;
-        case 1:
-            // PPUMASK is write only
-            break;
         case 2:
-            data = PPUSTATUS;
+            // only the top 3 bits are driven, reading ends vblank
+            data = (PPUSTATUS & 0xE0) | (openBus & 0x1F);
             PPUSTATUS &= 0x7F;
-            break;
-        case 3:
-            // OAMADDR is write only
+            addressLatch = false;
             break;
         case 4:
-            data = OAMDATA;
-            break;
-        case 5:
-            // PPUSCROLL is write only
+            data = oam[OAMADDR];
             break;
-        case 6:
-            // PPUADDR is write only
+        case 7: {
+            // palette reads come straight back, everything else goes
+            // through the read buffer. v is 15 bits but the bus only 14
+            u16 address = VRAMADDR & 0x3FFF;
+            if (address >= 0x3F00){
+                data = read(address);
+                readBuffer = read(address - 0x1000);
+            } else {
+                data = readBuffer;
+                readBuffer = read(address);
+            }
+            VRAMADDR = (VRAMADDR + ((PPUCTRL & 0x04) ? 32 : 1)) & 0x7FFF;
             break;
-        case 7:
-            data = read(VRAMADDR);
-            VRAMADDR += (PPUCTRL & 0b100) ? 1 : 32;
+        }
+        default:
+            // the rest are write only
             break;
     }
+    openBus = data;
     return data;
 }
 
 
+// $2004 writes and OAM DMA. Games DMA the whole table every frame,
+// so only a Y coordinate that really changed drops the sprite lines
+void PPU::writeOAM(u8 value){
+    if ((OAMADDR & 0x03) == 0 && oam[OAMADDR] != value)
+        memset(lineSpritesValid, 0, sizeof(lineSpritesValid));
+    oam[OAMADDR++] = value;
+}
+
+
+///////////////////////////////////////////////
+// PPU Memory                                //
+///////////////////////////////////////////////
+
+
+// $3F10/$3F14/$3F18/$3F1C are mirrors of $3F00/$3F04/$3F08/$3F0C
+u8 PPU::paletteAddress(u16 address){
+    address &= 0x1F;
+    if ((address & 0x13) == 0x10)
+        address &= 0x0F;
+    return address;
+}
+
+
 u8 PPU::read(u16 address){
+    address &= 0x3FFF;
+
     // pattern tables
-    if (address < 0x1000){
-        return patterntable1[address];
-    }
-    else if (address < 0x2000){
-        return patterntable2[address - 0x1000];
+    if (address < 0x2000){
+        return cart->readPPU(address);
     }
 
     // nametables
-    else if (address >= 0x2000 && address < 0x3EFF){
-        address &= 0xFFF;
-        if (address < 0x400){
-            return nametable1[address & 0x3FF];
-        }
-        else if (address < 0x800){
-            if (cart->mirroring == HORIZONTAL_MIRROR){
-                return nametable1[address & 0x3FF];
+    else if (address < 0x3F00){
+        u8 table = nametableLayout[cart->getMirroring()][(address >> 10) & 0x3];
+        return (table == 0) ? nametable1[address & 0x3FF] : nametable2[address & 0x3FF];
+    }
+
+    // Palette indices
+    return palettetable[paletteAddress(address)];
+}
+
+
+void PPU::write(u16 address, u8 value){
+    address &= 0x3FFF;
+
+    // pattern tables, only CHR RAM takes writes
+    if (address < 0x2000){
+        cart->writePPU(address, value);
+        tilesStale = true;
+    }
+    else if (address < 0x3F00){
+        u8 table = nametableLayout[cart->getMirroring()][(address >> 10) & 0x3];
+        if (table == 0)
+            nametable1[address & 0x3FF] = value;
+        else
+            nametable2[address & 0x3FF] = value;
+    }
+    else {
+        palettetable[paletteAddress(address)] = value & 0x3F;
+    }
+}
+
+
+// Called with every address the PPU puts on its bus for pattern data
+// or through PPUADDR. Only rising edges that get past the MMC3's filter
+// reach the mapper, and boards without a scanline counter skip it all
+void PPU::updateA12(u16 address){
+    if (!scanlineCounter)
+        return;
+
+    bool high = address & 0x1000;
+    if (high && !a12High && dots - a12LowSince >= A12_FILTER_DOTS){
+        a12ClockedAt = dots;
+        cart->a12Rising();
+    }
+    else if (!high && a12High)
+        a12LowSince = dots;
+    a12High = high;
+}
+
+
+///////////////////////////////////////////////
+// Timing                                    //
+///////////////////////////////////////////////
+
+
+void PPU::run(u64 count){
+    u64 target = dots + count;
+    while (dots < target){
+        // Between setting the vblank flag and the pre-render line nothing
+        // is fetched or drawn, so jump ahead as far as the budget allows
+        bool idle = (scanline == PPU_VBLANK_SCANLINE && dot > 1)
+            || (scanline > PPU_VBLANK_SCANLINE && scanline < PPU_PRERENDER_SCANLINE);
+        if (idle){
+            u64 skip = (PPU_PRERENDER_SCANLINE - scanline) * PPU_DOTS_PER_SCANLINE - dot;
+            skip = std::min(skip, target - dots);
+            dots += skip;
+            dot += skip;
+            scanline += dot / PPU_DOTS_PER_SCANLINE;
+            dot %= PPU_DOTS_PER_SCANLINE;
+            continue;
+        }
+
+        // Nothing can touch the PPU before the target, so whole visible
+        // lines can be drawn at once. Lines the CPU interrupts halfway
+        // through, by catching the PPU up to access it, go dot by dot
+        if (dot == 0 && scanline < FRAME_HEIGHT && target - dots >= PPU_DOTS_PER_SCANLINE && !accurateOnly){
+            renderLine();
+            continue;
+        }
+        step();
+    }
+}
+
+
+// runs the PPU up to the dot matching a CPU cycle
+void PPU::catchUp(u64 cycle){
+    u64 target = cycle * PPU_DOTS_PER_CPU_CYCLE;
+    if (target > dots)
+        run(target - dots);
+}
+
+
+// CPU cycle by which the PPU has to be caught up: the start of vblank,
+// which raises NMI and ends the frame, or the A12 rise a mapper counter
+// will raise its IRQ on. Sprite 0 hit can only be seen through $2002,
+// and reading that catches the PPU up anyway
+u64 PPU::nextEvent(){
+    int position = scanline * PPU_DOTS_PER_SCANLINE + dot;
+    int vblank = PPU_VBLANK_SCANLINE * PPU_DOTS_PER_SCANLINE + 1;
+    int frameDots = PPU_SCANLINES_PER_FRAME * PPU_DOTS_PER_SCANLINE;
+    u64 until = (position <= vblank) ? vblank - position + 1 : frameDots - position + vblank + 1;
+
+    // counters clock once per rendered line, aim for the
+    // earliest dot the line's A12 rise could come on
+    int clocks = renderingEnabled() ? cart->clocksUntilIrq() : -1;
+    int first = firstA12Rise();
+    if (clocks > 0 && first >= 0){
+        int line = scanline;
+        int lineStart = -dot;
+        int rise = nextA12Rise(first);
+        if (rise < 0){
+            line = (line + 1) % PPU_SCANLINES_PER_FRAME;
+            lineStart += PPU_DOTS_PER_SCANLINE;
+            rise = first;
+        }
+        while ((u64)(lineStart + rise + 1) < until){
+            if ((line < FRAME_HEIGHT || line == PPU_PRERENDER_SCANLINE) && --clocks == 0){
+                until = lineStart + rise + 1;
+                break;
             }
-            else if (cart->mirroring == VERTICAL_MIRROR){
-                return nametable2[address & 0x3FF];
+            line = (line + 1) % PPU_SCANLINES_PER_FRAME;
+            lineStart += PPU_DOTS_PER_SCANLINE;
+            rise = first;
+        }
+    }
+
+    return (dots + until + PPU_DOTS_PER_CPU_CYCLE - 1) / PPU_DOTS_PER_CPU_CYCLE;
+}
+
+
+// First dot of a line A12 can rise on, from the pattern tables in use.
+// Sprites at $1000 (8x16 ones can pick it) rise on the first sprite
+// fetch after $0000 background. $1000 background only lets A12 rise
+// once a $0000 sprite pulled it low for long enough, the third slot
+// at the earliest, or else on the next line's first tile. -1 if both
+// sit in the same table and A12 never moves
+int PPU::firstA12Rise(){
+    bool tall = PPUCTRL & 0x20;
+    bool spritesHigh = PPUCTRL & 0x08;
+    if (!(PPUCTRL & 0x10))
+        return (tall || spritesHigh) ? A12_SPRITE_RISE_DOT : -1;
+    if (tall)
+        return A12_SPRITE_RISE_DOT + 16;
+    return spritesHigh ? -1 : A12_BACKGROUND_RISE_DOT;
+}
+
+
+// The next dot of the current line A12 can still rise on, or -1 once
+// the line has clocked the counter or is past every fetch that could.
+// 8x16 sprites can rise on any slot, their fetches are 8 dots apart
+int PPU::nextA12Rise(int first){
+    if (dot <= first)
+        return first;
+
+    bool clocked = a12ClockedAt >= dots - dot + A12_SPRITE_RISE_DOT;
+    if (clocked || dot > A12_BACKGROUND_RISE_DOT)
+        return -1;
+
+    int slot = (dot - A12_SPRITE_RISE_DOT + 7) / 8;
+    return std::min(A12_SPRITE_RISE_DOT + slot * 8, A12_BACKGROUND_RISE_DOT);
+}
+
+
+// one dot of the visible, pre-render or post-render lines
+void PPU::step(){
+    if (scanline < FRAME_HEIGHT || scanline == PPU_PRERENDER_SCANLINE){
+        if (renderingEnabled())
+            renderDot();
+        else if (scanline < FRAME_HEIGHT && dot >= 1 && dot <= FRAME_WIDTH)
+            frame[scanline * FRAME_WIDTH + dot - 1] = palettetable[0];
+    }
+
+    if (dot == 1){
+        if (scanline == PPU_VBLANK_SCANLINE){
+            PPUSTATUS |= 0x80;
+            frameCount++;
+            if (PPUCTRL & 0x80)
+                bus->triggerNMI();
+        }
+        else if (scanline == PPU_PRERENDER_SCANLINE){
+            // vblank, sprite 0 hit and sprite overflow
+            PPUSTATUS &= 0x1F;
+        }
+    }
+
+    // odd frames are one dot shorter while rendering
+    if (scanline == PPU_PRERENDER_SCANLINE && dot == 339 && oddFrame && renderingEnabled())
+        dot++;
+
+    dots++;
+    if (++dot == PPU_DOTS_PER_SCANLINE){
+        if (scanline < FRAME_HEIGHT)
+            accurateLines++;
+        dot = 0;
+        if (++scanline == PPU_SCANLINES_PER_FRAME){
+            scanline = 0;
+            oddFrame = !oddFrame;
+        }
+    }
+}
+
+
+///////////////////////////////////////////////
+// Rendering                                 //
+///////////////////////////////////////////////
+
+
+// Fetches and shifts of one dot with rendering enabled, laid out
+// as in https://www.nesdev.org/wiki/PPU_rendering
+void PPU::renderDot(){
+    if ((dot >= 2 && dot <= 257) || (dot >= 321 && dot <= 337)){
+        shiftBackground();
+
+        switch ((dot - 1) & 0x07){
+            case 0:
+                loadBackground();
+                fetchNametable();
+                break;
+            case 2:
+                fetchAttribute();
+                break;
+            case 4:
+                fetchPattern(false);
+                break;
+            case 6:
+                fetchPattern(true);
+                break;
+            case 7:
+                incrementX();
+                break;
+        }
+    }
+
+    if (dot == 256)
+        incrementY();
+
+    if (dot == 257){
+        loadBackground();
+        VRAMADDR = (VRAMADDR & 0xFBE0) | (TRAMADDR & 0x041F);
+        evaluateSprites();
+    }
+
+    // sprite patterns for the next line, two fetches per slot
+    if (dot >= 257 && dot <= 320){
+        int phase = (dot - 257) & 0x07;
+        if (phase == 4 || phase == 6)
+            fetchSprite((dot - 257) >> 3, phase == 6);
+    }
+
+    // vertical scroll is reloaded all through the end of pre-render
+    if (scanline == PPU_PRERENDER_SCANLINE && dot >= 280 && dot <= 304)
+        VRAMADDR = (VRAMADDR & 0x841F) | (TRAMADDR & 0x7BE0);
+
+    if (scanline < FRAME_HEIGHT && dot >= 1 && dot <= FRAME_WIDTH)
+        drawPixel();
+}
+
+
+// Draws a whole visible line and leaves everything as 341 steps would
+// have. Only valid when nothing can touch the PPU before the line ends,
+// in which case the fetches can be done a tile at a time up front
+void PPU::renderLine(){
+    u64 lineStart = dots;
+    u8* out = &frame[scanline * FRAME_WIDTH];
+
+    if (!renderingEnabled()){
+        memset(out, palettetable[0], FRAME_WIDTH);
+    } else {
+        // Background as the shifters would see it, palette << 2 | pixel:
+        // the two tiles already loaded, then the 32 fetched on dots 1-256.
+        // The last one is never drawn but its fetch still clocks A12
+        bool showBackground = PPUMASK & 0x08;
+        u8 background[34 * 8] = {};
+        if (showBackground){
+            for (int bit = 0; bit < 16; bit++){
+                u16 mask = 0x8000 >> bit;
+                u8 pixel = ((patternShiftHigh & mask) ? 2 : 0) | ((patternShiftLow & mask) ? 1 : 0);
+                u8 pal = ((attributeShiftHigh & mask) ? 2 : 0) | ((attributeShiftLow & mask) ? 1 : 0);
+                background[bit] = (pal << 2) | pixel;
             }
         }
-        else if (address < 0xC00){
-            if (cart->mirroring == HORIZONTAL_MIRROR){
-                return nametable2[address & 0x3FF];
+
+        for (int tile = 2; tile < 34; tile++){
+            u64 tileStart = lineStart + (tile - 2) * 8 + 1;
+            // the first tile's name was fetched on the previous line
+            if (tile > 2)
+                fetchNametable();
+            fetchAttribute();
+
+            u16 address = backgroundAddress();
+            dots = tileStart + 4;
+            updateA12(address);
+            dots = tileStart + 6;
+            updateA12(address + 8);
+            incrementX();
+
+            if (showBackground){
+                u64 pixels;
+                memcpy(&pixels, tileRow(address, false), 8);
+                pixels |= (nextTileAttribute << 2) * 0x0101010101010101ull;
+                memcpy(background + tile * 8, &pixels, 8);
             }
-            else if (cart->mirroring == VERTICAL_MIRROR){
-                return nametable1[address & 0x3FF];
+        }
+        if (showBackground && !(PPUMASK & 0x02))
+            memset(background + fineX, 0, 8);
+
+        // sprites drawn back to front, so the lowest OAM index wins
+        u8 sprites[FRAME_WIDTH] = {};
+        if (PPUMASK & 0x10){
+            for (int i = spriteCount - 1; i >= 0; i--){
+                u8 flags = spriteFlags(i);
+                for (int column = 0; column < 8 && spriteX[i] + column < FRAME_WIDTH; column++){
+                    if (u8 pixel = spriteRowPixels[i][column])
+                        sprites[spriteX[i] + column] = pixel | flags;
+                }
             }
+            if (!(PPUMASK & 0x04))
+                memset(sprites, 0, 8);
         }
-        else if (address < 0xFFF){
-            return nametable2[address & 0x3FF];
+
+        for (int x = 0; x < FRAME_WIDTH; x++)
+            out[x] = mixPixel(x, background[x + fineX], sprites[x]);
+
+        incrementY();
+        VRAMADDR = (VRAMADDR & 0xFBE0) | (TRAMADDR & 0x041F);
+        evaluateSprites();
+        for (int slot = 0; slot < 8; slot++){
+            dots = lineStart + 261 + slot * 8;
+            fetchSprite(slot, false);
+            dots += 2;
+            fetchSprite(slot, true);
+        }
+
+        // dots 321-337 load the first two tiles of the next line
+        for (int tile = 0; tile < 2; tile++){
+            u64 tileStart = lineStart + 321 + tile * 8;
+            loadBackground();
+            fetchNametable();
+            fetchAttribute();
+            dots = tileStart + 4;
+            fetchPattern(false);
+            dots = tileStart + 6;
+            fetchPattern(true);
+            incrementX();
+            shiftBackground(8);
         }
+        loadBackground();
+        fetchNametable();
     }
-    
-    // Palette indices
-    else if(address < 0x3FFF){
-        address &= 0x1F;
 
-        // Nesdev: Addresses $3F10/$3F14/$3F18/$3F1C are mirrors of $3F00/$3F04/$3F08/$3F0C
-        address = (address == 0x10) ? 0x00 : address;
-        address = (address == 0x14) ? 0x04 : address;
-        address = (address == 0x18) ? 0x08 : address;
-        address = (address == 0x1C) ? 0x0C : address;
-        return palettetable[address];
+    dots = lineStart + PPU_DOTS_PER_SCANLINE;
+    scanline++;
+    fastLines++;
+}
+
+
+void PPU::shiftBackground(int count){
+    patternShiftLow <<= count;
+    patternShiftHigh <<= count;
+    attributeShiftLow <<= count;
+    attributeShiftHigh <<= count;
+}
+
+
+void PPU::fetchNametable(){
+    nextTileId = read(0x2000 | (VRAMADDR & 0x0FFF));
+}
+
+
+// 2 bits of palette per 16x16 pixel quadrant
+void PPU::fetchAttribute(){
+    nextTileAttribute = read(0x23C0 | (VRAMADDR & 0x0C00)
+        | ((VRAMADDR >> 4) & 0x38) | ((VRAMADDR >> 2) & 0x07));
+    if (VRAMADDR & 0x40)
+        nextTileAttribute >>= 4;
+    if (VRAMADDR & 0x02)
+        nextTileAttribute >>= 2;
+    nextTileAttribute &= 0x03;
+}
+
+
+// low plane of the current row of the next tile
+u16 PPU::backgroundAddress(){
+    return ((PPUCTRL & 0x10) << 8) + (nextTileId << 4) + (VRAMADDR >> 12);
+}
+
+
+void PPU::fetchPattern(bool high){
+    u16 address = backgroundAddress() + (high ? 8 : 0);
+    updateA12(address);
+    if (high)
+        nextTileHigh = read(address);
+    else
+        nextTileLow = read(address);
+}
+
+
+// the fetched tile goes into the low byte of the shifters,
+// behind the tile that is being drawn
+void PPU::loadBackground(){
+    patternShiftLow = (patternShiftLow & 0xFF00) | nextTileLow;
+    patternShiftHigh = (patternShiftHigh & 0xFF00) | nextTileHigh;
+    attributeShiftLow = (attributeShiftLow & 0xFF00) | ((nextTileAttribute & 0x01) ? 0xFF : 0x00);
+    attributeShiftHigh = (attributeShiftHigh & 0xFF00) | ((nextTileAttribute & 0x02) ? 0xFF : 0x00);
+}
+
+
+// coarse X, wrapping into the horizontally adjacent nametable
+void PPU::incrementX(){
+    if ((VRAMADDR & 0x001F) == 31){
+        VRAMADDR &= ~0x001F;
+        VRAMADDR ^= 0x0400;
+    } else {
+        VRAMADDR++;
     }
 }
 
 
-void PPU::write(u16 address, u8 value){
-    //BRRRRRRRRRRR
+// fine Y, then coarse Y, wrapping into the vertically adjacent nametable
+void PPU::incrementY(){
+    if ((VRAMADDR & 0x7000) != 0x7000){
+        VRAMADDR += 0x1000;
+        return;
+    }
+
+    VRAMADDR &= ~0x7000;
+    u16 coarseY = (VRAMADDR & 0x03E0) >> 5;
+    if (coarseY == 29){
+        coarseY = 0;
+        VRAMADDR ^= 0x0800;
+    } else if (coarseY == 31){
+        // rows 30 and 31 are attribute data, no table switch
+        coarseY = 0;
+    } else {
+        coarseY++;
+    }
+    VRAMADDR = (VRAMADDR & ~0x03E0) | (coarseY << 5);
+}
+
+
+// Bitmask of the OAM entries whose Y puts them on line, bit n for
+// sprite n. The 64 Y bytes are packed out of the entries and compared
+// all at once: in range means Y <= line and line - Y < height, which
+// saturating subtracts can test without leaving 8 bits
+
+#if defined(__AVX2__)
+
+static u64 matchSprites(const u8* oam, int line, int height){
+    const __m256i yOnly = _mm256_set1_epi32(0xFF);
+    const __m256i lines = _mm256_set1_epi8((char)line);
+    const __m256i lastRow = _mm256_set1_epi8((char)(height - 1));
+    // packs work within 128 bit lanes, this puts the dwords back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    u64 mask = 0;
+    for (int group = 0; group < 2; group++){
+        const __m256i* entries = (const __m256i*)(oam + group * 128);
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256(entries), yOnly);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256(entries + 1), yOnly);
+        __m256i c = _mm256_and_si256(_mm256_loadu_si256(entries + 2), yOnly);
+        __m256i d = _mm256_and_si256(_mm256_loadu_si256(entries + 3), yOnly);
+        __m256i y = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        y = _mm256_permutevar8x32_epi32(y, order);
+
+        __m256i above = _mm256_subs_epu8(y, lines);
+        __m256i below = _mm256_subs_epu8(_mm256_subs_epu8(lines, y), lastRow);
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_or_si256(above, below), _mm256_setzero_si256());
+        mask |= (u64)(u32)_mm256_movemask_epi8(hit) << (group * 32);
+    }
+    return mask;
+}
+
+#elif defined(__SSE2__)
+
+static u64 matchSprites(const u8* oam, int line, int height){
+    const __m128i yOnly = _mm_set1_epi32(0xFF);
+    const __m128i lines = _mm_set1_epi8((char)line);
+    const __m128i lastRow = _mm_set1_epi8((char)(height - 1));
+
+    u64 mask = 0;
+    for (int group = 0; group < 4; group++){
+        const __m128i* entries = (const __m128i*)(oam + group * 64);
+        __m128i a = _mm_and_si128(_mm_loadu_si128(entries), yOnly);
+        __m128i b = _mm_and_si128(_mm_loadu_si128(entries + 1), yOnly);
+        __m128i c = _mm_and_si128(_mm_loadu_si128(entries + 2), yOnly);
+        __m128i d = _mm_and_si128(_mm_loadu_si128(entries + 3), yOnly);
+        __m128i y = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+
+        __m128i above = _mm_subs_epu8(y, lines);
+        __m128i below = _mm_subs_epu8(_mm_subs_epu8(lines, y), lastRow);
+        __m128i hit = _mm_cmpeq_epi8(_mm_or_si128(above, below), _mm_setzero_si128());
+        mask |= (u64)(u16)_mm_movemask_epi8(hit) << (group * 16);
+    }
+    return mask;
 }
 
+#else
 
-void PPU::loadStuffFromCart(){
-    for (int i = 0; i < 0x1000; i++){
-        nametable1[i] = cart->readPPU(i);
-        nametable2[i + 0x1000] = cart->readPPU(i + 0x1000);
+static u64 matchSprites(const u8* oam, int line, int height){
+    u64 mask = 0;
+    for (int n = 0; n < 64; n++){
+        int row = line - oam[n * 4];
+        if (row >= 0 && row < height)
+            mask |= 1ull << n;
     }
+    return mask;
 }
 
+#endif
 
-u32 PPU::readFromPalette(u8 pal, u8 index){
-    u8 index = read(0x3000 + (pal << 2) + index);
-    return palette[index & 0x3F];
+
+// Sprites on the line being evaluated. Kept per line until a Y
+// coordinate or the sprite size changes, so while OAM stays put
+// whole frames go by without comparing anything
+u64 PPU::spritesOnLine(int height){
+    if (height != lineSpritesHeight){
+        memset(lineSpritesValid, 0, sizeof(lineSpritesValid));
+        lineSpritesHeight = height;
+    }
+
+    u64 bit = 1ull << (scanline & 63);
+    u64& valid = lineSpritesValid[scanline >> 6];
+    if (!(valid & bit)){
+        lineSprites[scanline] = matchSprites(oam, scanline, height);
+        valid |= bit;
+    }
+    return lineSprites[scanline];
+}
+
+
+// Finds the first 8 sprites on the next line. Past that, the hardware
+// looks for a 9th with a broken OAM index that also steps through the
+// bytes of each entry, which is emulated for the overflow flag
+void PPU::evaluateSprites(){
+    spriteCount = 0;
+    spriteZeroInLine = false;
+    if (scanline == PPU_PRERENDER_SCANLINE)
+        return;
+
+    int height = (PPUCTRL & 0x20) ? 16 : 8;
+    u64 found = spritesOnLine(height);
+    spriteZeroInLine = found & 0x01;
+
+    // lowest OAM index first
+    int n = 0;
+    while (found && spriteCount < 8){
+        n = __builtin_ctzll(found);
+        found &= found - 1;
+        spriteRow[spriteCount] = scanline - oam[n * 4];
+        spriteTile[spriteCount] = oam[n * 4 + 1];
+        spriteAttribute[spriteCount] = oam[n * 4 + 2];
+        spriteX[spriteCount] = oam[n * 4 + 3];
+        spriteCount++;
+    }
+    if (spriteCount < 8)
+        return;
+
+    // the broken scan reads more than Y, so it can't use the mask
+    n++;
+    for (int m = 0; n < 64; n++){
+        int row = scanline - oam[n * 4 + m];
+        if (row >= 0 && row < height){
+            PPUSTATUS |= 0x20;
+            break;
+        }
+        m = (m + 1) & 0x03;
+    }
+}
+
+
+// Empty slots still fetch tile $FF, which keeps the
+// A12 pattern the MMC3 counts scanlines with intact
+void PPU::fetchSprite(int slot, bool high){
+    bool tall = PPUCTRL & 0x20;
+    u8 tile = 0xFF;
+    int row = 0;
+    u8 attribute = 0;
+    if (slot < spriteCount){
+        tile = spriteTile[slot];
+        row = spriteRow[slot];
+        attribute = spriteAttribute[slot];
+        if (attribute & 0x80)
+            row = (tall ? 15 : 7) - row;
+    }
+
+    u16 address;
+    if (tall){
+        // 8x16 sprites pick their table with bit 0 of the tile
+        address = ((tile & 0x01) << 12) | ((tile & 0xFE) << 4);
+        if (row >= 8)
+            address += 16;
+    } else {
+        address = ((PPUCTRL & 0x08) << 9) | (tile << 4);
+    }
+    address += row & 0x07;
+    u16 plane = address + (high ? 8 : 0);
+
+    updateA12(plane);
+    if (slot >= spriteCount)
+        return;
+
+    u8 pattern = read(plane);
+    if (attribute & 0x40){
+        // horizontal flip, reverse the bits
+        pattern = (pattern & 0xF0) >> 4 | (pattern & 0x0F) << 4;
+        pattern = (pattern & 0xCC) >> 2 | (pattern & 0x33) << 2;
+        pattern = (pattern & 0xAA) >> 1 | (pattern & 0x55) << 1;
+    }
+    if (!high){
+        spriteLow[slot] = pattern;
+        spriteRowAddress[slot] = address;
+        syncTiles();
+        return;
+    }
+    spriteHigh[slot] = pattern;
+
+    // The line renderer takes the row from the tile cache, unless the
+    // CPU got in between the two fetches and the planes don't match:
+    // CHR changed, PPUCTRL moved the row or rendering was switched on
+    bool samePlanes = spriteRowAddress[slot] == address && !tilesStale;
+    spriteRowAddress[slot] = NO_SPRITE_ROW;
+    if (samePlanes){
+        memcpy(spriteRowPixels[slot], tileCache.row(address >> 4, address & 0x07, attribute & 0x40), 8);
+        return;
+    }
+    for (int column = 0; column < 8; column++){
+        int shift = 7 - column;
+        spriteRowPixels[slot][column] = (((spriteHigh[slot] >> shift) & 0x01) << 1) | ((spriteLow[slot] >> shift) & 0x01);
+    }
+}
+
+
+// Picks the background and sprite pixel at dot - 1 out of
+// the shifters and writes their palette index into the frame
+void PPU::drawPixel(){
+    int x = dot - 1;
+
+    u8 background = 0;
+    if ((PPUMASK & 0x08) && (x >= 8 || (PPUMASK & 0x02))){
+        u16 bit = 0x8000 >> fineX;
+        u8 pixel = ((patternShiftHigh & bit) ? 2 : 0) | ((patternShiftLow & bit) ? 1 : 0);
+        u8 pal = ((attributeShiftHigh & bit) ? 2 : 0) | ((attributeShiftLow & bit) ? 1 : 0);
+        background = (pal << 2) | pixel;
+    }
+
+    // lowest OAM index wins, even if it is behind the background
+    u8 sprite = 0;
+    if ((PPUMASK & 0x10) && (x >= 8 || (PPUMASK & 0x04))){
+        for (int i = 0; i < spriteCount && !sprite; i++){
+            int column = x - spriteX[i];
+            if (column >= 0 && column <= 7)
+                sprite = spritePixel(i, column);
+        }
+    }
+
+    frame[scanline * FRAME_WIDTH + x] = mixPixel(x, background, sprite);
 }
 
 
-GLuint PPU::renderNT1(){
-    int temp;
-    glBindTexture(GL_TEXTURE_2D, NT1_id);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 100, 100, GL_RGBA, GL_UNSIGNED_BYTE, static_cast<const GLvoid*>(nametable1));
-    return NT1_id;
+// A slot's pixel as palette << 2 | pixel, with SPRITE_BEHIND and
+// SPRITE_ZERO on top. 0 where the sprite is transparent
+u8 PPU::spritePixel(int slot, int column){
+    int shift = 7 - column;
+    u8 pixel = (((spriteHigh[slot] >> shift) & 0x01) << 1) | ((spriteLow[slot] >> shift) & 0x01);
+    return pixel ? pixel | spriteFlags(slot) : 0;
+}
+
+
+u8 PPU::spriteFlags(int slot){
+    u8 flags = ((spriteAttribute[slot] & 0x03) + 4) << 2;
+    if (spriteAttribute[slot] & 0x20)
+        flags |= SPRITE_BEHIND;
+    if (spriteZeroInLine && slot == 0)
+        flags |= SPRITE_ZERO;
+    return flags;
+}
+
+
+// Priority between the background and sprite pixel at x, both given as
+// palette << 2 | pixel. Returns the palette index that ends up on screen
+u8 PPU::mixPixel(int x, u8 background, u8 sprite){
+    u8 colour = 0;
+    if ((background & 0x03) && (sprite & 0x03)){
+        if ((sprite & SPRITE_ZERO) && x != 255)
+            PPUSTATUS |= 0x40;
+        colour = (sprite & SPRITE_BEHIND) ? background : sprite;
+    } else if (background & 0x03){
+        colour = background;
+    } else if (sprite & 0x03){
+        colour = sprite;
+    }
+
+    u8 index = palettetable[colour & 0x1F];
+    if (PPUMASK & 0x01)
+        index &= 0x30;
+    return index;
 }
 
 
-GLuint PPU::renderNT2(){
-    int temp;
-    glBindTexture(GL_TEXTURE_2D, NT2_id);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 100, 100, GL_RGBA, GL_UNSIGNED_BYTE, static_cast<const GLvoid*>(nametable2));
-    return NT1_id;
+// Pixels of the tile row at a pattern address. The cache is only
+// synced when CHR may have changed, which is rarely mid-frame
+const u8* PPU::tileRow(u16 address, bool flip){
+    syncTiles();
+    return tileCache.row(address >> 4, address & 0x07, flip);
+}
+
+
+void PPU::syncTiles(){
+    if (tilesStale){
+        tileCache.sync();
+        tilesStale = false;
+    }
+}
+
+
+///////////////////////////////////////////////
+// Output                                    //
+///////////////////////////////////////////////
+
+
+const u8* PPU::getFrame(){
+    return frame;
+}
+
+
+// converts the frame to RGBA and uploads it
+GLuint PPU::renderFrame(){
+    for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i++){
+        u32 rgb = palette[frame[i]];
+        frameRGBA[i] = 0xFF000000 | (rgb & 0x00FF00) | ((rgb >> 16) & 0xFF) | ((rgb & 0xFF) << 16);
+    }
+    glBindTexture(GL_TEXTURE_2D, frameTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, FRAME_WIDTH, FRAME_HEIGHT,
+        GL_RGBA, GL_UNSIGNED_BYTE, static_cast<const GLvoid*>(frameRGBA));
+    return frameTexture;
 }
 
 
@@ -191,4 +921,8 @@ void PPU::initTexture(GLuint &texture){
     glEnable(GL_TEXTURE_2D);
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
-}
\ No newline at end of file
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, FRAME_WIDTH, FRAME_HEIGHT, 0,
+        GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+}
@@ -0,0 +1,959 @@
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+#include <sys/mman.h>
+
+#include "../include/recompiler.h"
+#include "../include/6502.h"
+#include "../include/bus.h"
+
+// size of the code buffer, and the room kept free for the next block
+#define CODE_SIZE (16 << 20)
+#define CODE_MARGIN (64 << 10)
+
+// longest run of instructions translated into one native block,
+// the rest of a decoded block gets a native block of its own
+#define MAX_BLOCK_INSTRUCTIONS 64
+
+// Host registers. A, X, Y and the cycle count are pinned for the length
+// of a block, R14 holds the CPU and RBP the bus read page table. Blocks
+// keep the cycle target at [RSP] and use [RSP+8] and [RSP+16] as scratch
+enum HostReg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+#define REG_A RBX
+#define REG_X R12
+#define REG_Y R13
+#define REG_CPU R14
+#define REG_CYCLES R15
+
+// x86 condition codes
+enum Condition {
+    CC_O = 0x0, CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5,
+};
+
+// the /digit of the group 1 ALU (0x80/0x81) and shift (0xC0/0xD0) opcodes
+enum AluDigit { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5 };
+enum ShiftDigit { SHIFT_RCL = 2, SHIFT_RCR = 3, SHIFT_SHL = 4, SHIFT_SHR = 5 };
+
+
+///////////////////////////////////////////////
+// x86-64 Encoding                           //
+///////////////////////////////////////////////
+
+
+// Just the encodings the translator uses. Memory operands are always
+// [base + disp32], register operands are 32 bit unless the name says
+// otherwise. Forward jumps return the end of their rel32 for bind()
+class Recompiler::Emitter
+{
+public:
+
+    explicit Emitter(u8* start) : p(start) {}
+    u8* p;
+
+    void byte(u8 value){ *p++ = value; }
+    void word(u16 value){ memcpy(p, &value, 2); p += 2; }
+    void dword(u32 value){ memcpy(p, &value, 4); p += 4; }
+    void qword(u64 value){ memcpy(p, &value, 8); p += 8; }
+
+    // Only emitted when needed. Byte registers 4-7 need an empty one to
+    // mean SPL-DIL instead of AH-BH, extra ones are harmless
+    void rex(bool wide, int reg, int base, bool byteRegs = false){
+        u8 prefix = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((base & 8) >> 3);
+        if (prefix != 0x40 || byteRegs)
+            byte(prefix);
+    }
+    static bool needsRex(int reg){ return reg >= RSP && reg <= RDI; }
+
+    // opcode reg, [base + disp32]
+    void mem(std::initializer_list<u8> opcode, int reg, int base, s32 disp, bool wide = false, bool byteReg = false){
+        rex(wide, reg, base, byteReg && needsRex(reg));
+        for (u8 value : opcode)
+            byte(value);
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        dword(disp);
+    }
+
+    // opcode reg, rm
+    void regs(std::initializer_list<u8> opcode, int reg, int rm, bool wide = false, bool byteRegs = false){
+        rex(wide, reg, rm, byteRegs && (needsRex(reg) || needsRex(rm)));
+        for (u8 value : opcode)
+            byte(value);
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void load8(int reg, int base, s32 disp)        { mem({0x0F, 0xB6}, reg, base, disp); }
+    void load32(int reg, int base, s32 disp)       { mem({0x8B}, reg, base, disp); }
+    void load64(int reg, int base, s32 disp)       { mem({0x8B}, reg, base, disp, true); }
+    void store8(int base, s32 disp, int reg)       { mem({0x88}, reg, base, disp, false, true); }
+    void store16(int base, s32 disp, int reg)      { byte(0x66); mem({0x89}, reg, base, disp); }
+    void store32(int base, s32 disp, int reg)      { mem({0x89}, reg, base, disp); }
+    void store64(int base, s32 disp, int reg)      { mem({0x89}, reg, base, disp, true); }
+    void store8Imm(int base, s32 disp, u8 imm)     { mem({0xC6}, 0, base, disp); byte(imm); }
+    void store16Imm(int base, s32 disp, u16 imm)   { byte(0x66); mem({0xC7}, 0, base, disp); word(imm); }
+    void aluMem8(int digit, int base, s32 disp, u8 imm){ mem({0x80}, digit, base, disp); byte(imm); }
+    void orMem8(int base, s32 disp, int reg)       { mem({0x08}, reg, base, disp, false, true); }
+    void testMem8(int base, s32 disp, u8 imm)      { mem({0xF6}, 0, base, disp); byte(imm); }
+    void incMem8(int base, s32 disp)               { mem({0xFE}, 0, base, disp); }
+    void decMem8(int base, s32 disp)               { mem({0xFE}, 1, base, disp); }
+    void or32(int reg, int base, s32 disp)         { mem({0x0B}, reg, base, disp); }
+    void cmp64(int reg, int base, s32 disp)        { mem({0x3B}, reg, base, disp, true); }
+
+    void mov32(int dst, int src)                   { regs({0x89}, src, dst); }
+    void mov64(int dst, int src)                   { regs({0x89}, src, dst, true); }
+    void movzx8(int dst, int src)                  { regs({0x0F, 0xB6}, dst, src, false, true); }
+    void movzx16(int dst, int src)                 { regs({0x0F, 0xB7}, dst, src); }
+    void movImm32(int reg, u32 imm)                { rex(false, 0, reg); byte(0xB8 | (reg & 7)); dword(imm); }
+    void movImm64(int reg, u64 imm)                { rex(true, 0, reg); byte(0xB8 | (reg & 7)); qword(imm); }
+
+    // dst op= src, op being the "r/m, r" form (0x00 add, 0x08 or, ...)
+    void alu8(u8 op, int dst, int src)             { regs({op}, src, dst, false, true); }
+    void alu32(u8 op, int dst, int src)            { regs({(u8) (op | 1)}, src, dst); }
+    void alu64(u8 op, int dst, int src)            { regs({(u8) (op | 1)}, src, dst, true); }
+    void alu32Imm(int digit, int reg, u32 imm)     { regs({0x81}, digit, reg); dword(imm); }
+    void alu64Imm(int digit, int reg, u32 imm)     { regs({0x81}, digit, reg, true); dword(imm); }
+    void shift8(int digit, int reg)                { regs({0xD0}, digit, reg, false, true); }
+    void shift8Imm(int digit, int reg, u8 count)   { regs({0xC0}, digit, reg, false, true); byte(count); }
+    void shift32Imm(int digit, int reg, u8 count)  { regs({0xC1}, digit, reg); byte(count); }
+    void inc8(int reg)                             { regs({0xFE}, 0, reg, false, true); }
+    void dec8(int reg)                             { regs({0xFE}, 1, reg, false, true); }
+    void inc32(int reg)                            { regs({0xFF}, 0, reg); }
+    void not32(int reg)                            { regs({0xF7}, 2, reg); }
+    void test64(int a, int b)                      { regs({0x85}, b, a, true); }
+    void setcc(int condition, int reg)             { regs({0x0F, (u8) (0x90 | condition)}, 0, reg, false, true); }
+    void bt32(int reg, u8 bit)                     { regs({0x0F, 0xBA}, 4, reg); byte(bit); }
+    void cmc()                                     { byte(0xF5); }
+
+    void push(int reg)                             { rex(false, 0, reg); byte(0x50 | (reg & 7)); }
+    void pop(int reg)                              { rex(false, 0, reg); byte(0x58 | (reg & 7)); }
+    void call(int reg)                             { regs({0xFF}, 2, reg); }
+    void jmpReg(int reg)                           { regs({0xFF}, 4, reg); }
+    void ret()                                     { byte(0xC3); }
+
+    // reg = [RBP + RCX * 8 + disp], the page table entry for page RCX
+    void loadPage(int reg, s32 disp){
+        rex(true, reg, RBP);
+        byte(0x8B);
+        byte(0x84 | ((reg & 7) << 3));
+        byte(0xCD);
+        dword(disp);
+    }
+
+    // movzx eax, byte [rdx + rcx] and mov [rdx + rcx], al
+    void loadByte(){ byte(0x0F); byte(0xB6); byte(0x04); byte(0x0A); }
+    void storeByte(){ byte(0x88); byte(0x04); byte(0x0A); }
+
+    u8* jcc(int condition){ byte(0x0F); byte(0x80 | condition); dword(0); return p; }
+    u8* jmp(){ byte(0xE9); dword(0); return p; }
+    void bind(u8* jump){ s32 rel = p - jump; memcpy(jump - 4, &rel, 4); }
+    void jmpTo(const u8* target){ byte(0xE9); dword((u32) (target - (p + 4))); }
+};
+
+
+///////////////////////////////////////////////
+// Translation Table                         //
+///////////////////////////////////////////////
+
+
+// What each opcode translates to, same layout as the CPU opcode table.
+// Anything marked INTERPRET runs its interpreter handler: BRK, JMP
+// indirect and every unofficial opcode
+const Recompiler::Translation Recompiler::translations[256] = {
+    /* 0x00 */ {INTERPRET},       {ORA, CPU::_IDX},  {INTERPRET},       {INTERPRET},
+    /* 0x04 */ {INTERPRET},       {ORA, CPU::_ZPG},  {ASL, CPU::_ZPG},  {INTERPRET},
+    /* 0x08 */ {PHP},             {ORA, CPU::_IMM},  {ASL, CPU::_ACC},  {INTERPRET},
+    /* 0x0C */ {INTERPRET},       {ORA, CPU::_ABS},  {ASL, CPU::_ABS},  {INTERPRET},
+
+    /* 0x10 */ {BPL},             {ORA, CPU::_IDY},  {INTERPRET},       {INTERPRET},
+    /* 0x14 */ {INTERPRET},       {ORA, CPU::_ZPX},  {ASL, CPU::_ZPX},  {INTERPRET},
+    /* 0x18 */ {CLC},             {ORA, CPU::_ABY},  {INTERPRET},       {INTERPRET},
+    /* 0x1C */ {INTERPRET},       {ORA, CPU::_ABX},  {ASL, CPU::_ABX},  {INTERPRET},
+
+    /* 0x20 */ {JSR, CPU::_ABS},  {AND, CPU::_IDX},  {INTERPRET},       {INTERPRET},
+    /* 0x24 */ {BIT, CPU::_ZPG},  {AND, CPU::_ZPG},  {ROL, CPU::_ZPG},  {INTERPRET},
+    /* 0x28 */ {PLP},             {AND, CPU::_IMM},  {ROL, CPU::_ACC},  {INTERPRET},
+    /* 0x2C */ {BIT, CPU::_ABS},  {AND, CPU::_ABS},  {ROL, CPU::_ABS},  {INTERPRET},
+
+    /* 0x30 */ {BMI},             {AND, CPU::_IDY},  {INTERPRET},       {INTERPRET},
+    /* 0x34 */ {INTERPRET},       {AND, CPU::_ZPX},  {ROL, CPU::_ZPX},  {INTERPRET},
+    /* 0x38 */ {SEC},             {AND, CPU::_ABY},  {INTERPRET},       {INTERPRET},
+    /* 0x3C */ {INTERPRET},       {AND, CPU::_ABX},  {ROL, CPU::_ABX},  {INTERPRET},
+
+    /* 0x40 */ {RTI},             {EOR, CPU::_IDX},  {INTERPRET},       {INTERPRET},
+    /* 0x44 */ {INTERPRET},       {EOR, CPU::_ZPG},  {LSR, CPU::_ZPG},  {INTERPRET},
+    /* 0x48 */ {PHA},             {EOR, CPU::_IMM},  {LSR, CPU::_ACC},  {INTERPRET},
+    /* 0x4C */ {JMP, CPU::_ABS},  {EOR, CPU::_ABS},  {LSR, CPU::_ABS},  {INTERPRET},
+
+    /* 0x50 */ {BVC},             {EOR, CPU::_IDY},  {INTERPRET},       {INTERPRET},
+    /* 0x54 */ {INTERPRET},       {EOR, CPU::_ZPX},  {LSR, CPU::_ZPX},  {INTERPRET},
+    /* 0x58 */ {CLI},             {EOR, CPU::_ABY},  {INTERPRET},       {INTERPRET},
+    /* 0x5C */ {INTERPRET},       {EOR, CPU::_ABX},  {LSR, CPU::_ABX},  {INTERPRET},
+
+    /* 0x60 */ {RTS},             {ADC, CPU::_IDX},  {INTERPRET},       {INTERPRET},
+    /* 0x64 */ {INTERPRET},       {ADC, CPU::_ZPG},  {ROR, CPU::_ZPG},  {INTERPRET},
+    /* 0x68 */ {PLA},             {ADC, CPU::_IMM},  {ROR, CPU::_ACC},  {INTERPRET},
+    /* 0x6C */ {INTERPRET},       {ADC, CPU::_ABS},  {ROR, CPU::_ABS},  {INTERPRET},
+
+    /* 0x70 */ {BVS},             {ADC, CPU::_IDY},  {INTERPRET},       {INTERPRET},
+    /* 0x74 */ {INTERPRET},       {ADC, CPU::_ZPX},  {ROR, CPU::_ZPX},  {INTERPRET},
+    /* 0x78 */ {SEI},             {ADC, CPU::_ABY},  {INTERPRET},       {INTERPRET},
+    /* 0x7C */ {INTERPRET},       {ADC, CPU::_ABX},  {ROR, CPU::_ABX},  {INTERPRET},
+
+    /* 0x80 */ {INTERPRET},       {STA, CPU::_IDX},  {INTERPRET},       {INTERPRET},
+    /* 0x84 */ {STY, CPU::_ZPG},  {STA, CPU::_ZPG},  {STX, CPU::_ZPG},  {INTERPRET},
+    /* 0x88 */ {DEY},             {INTERPRET},       {TXA},             {INTERPRET},
+    /* 0x8C */ {STY, CPU::_ABS},  {STA, CPU::_ABS},  {STX, CPU::_ABS},  {INTERPRET},
+
+    /* 0x90 */ {BCC},             {STA, CPU::_IDY},  {INTERPRET},       {INTERPRET},
+    /* 0x94 */ {STY, CPU::_ZPX},  {STA, CPU::_ZPX},  {STX, CPU::_ZPY},  {INTERPRET},
+    /* 0x98 */ {TYA},             {STA, CPU::_ABY},  {TXS},             {INTERPRET},
+    /* 0x9C */ {INTERPRET},       {STA, CPU::_ABX},  {INTERPRET},       {INTERPRET},
+
+    /* 0xA0 */ {LDY, CPU::_IMM},  {LDA, CPU::_IDX},  {LDX, CPU::_IMM},  {INTERPRET},
+    /* 0xA4 */ {LDY, CPU::_ZPG},  {LDA, CPU::_ZPG},  {LDX, CPU::_ZPG},  {INTERPRET},
+    /* 0xA8 */ {TAY},             {LDA, CPU::_IMM},  {TAX},             {INTERPRET},
+    /* 0xAC */ {LDY, CPU::_ABS},  {LDA, CPU::_ABS},  {LDX, CPU::_ABS},  {INTERPRET},
+
+    /* 0xB0 */ {BCS},             {LDA, CPU::_IDY},  {INTERPRET},       {INTERPRET},
+    /* 0xB4 */ {LDY, CPU::_ZPX},  {LDA, CPU::_ZPX},  {LDX, CPU::_ZPY},  {INTERPRET},
+    /* 0xB8 */ {CLV},             {LDA, CPU::_ABY},  {TSX},             {INTERPRET},
+    /* 0xBC */ {LDY, CPU::_ABX},  {LDA, CPU::_ABX},  {LDX, CPU::_ABY},  {INTERPRET},
+
+    /* 0xC0 */ {CPY, CPU::_IMM},  {CMP, CPU::_IDX},  {INTERPRET},       {INTERPRET},
+    /* 0xC4 */ {CPY, CPU::_ZPG},  {CMP, CPU::_ZPG},  {DEC, CPU::_ZPG},  {INTERPRET},
+    /* 0xC8 */ {INY},             {CMP, CPU::_IMM},  {DEX},             {INTERPRET},
+    /* 0xCC */ {CPY, CPU::_ABS},  {CMP, CPU::_ABS},  {DEC, CPU::_ABS},  {INTERPRET},
+
+    /* 0xD0 */ {BNE},             {CMP, CPU::_IDY},  {INTERPRET},       {INTERPRET},
+    /* 0xD4 */ {INTERPRET},       {CMP, CPU::_ZPX},  {DEC, CPU::_ZPX},  {INTERPRET},
+    /* 0xD8 */ {CLD},             {CMP, CPU::_ABY},  {INTERPRET},       {INTERPRET},
+    /* 0xDC */ {INTERPRET},       {CMP, CPU::_ABX},  {DEC, CPU::_ABX},  {INTERPRET},
+
+    /* 0xE0 */ {CPX, CPU::_IMM},  {SBC, CPU::_IDX},  {INTERPRET},       {INTERPRET},
+    /* 0xE4 */ {CPX, CPU::_ZPG},  {SBC, CPU::_ZPG},  {INC, CPU::_ZPG},  {INTERPRET},
+    /* 0xE8 */ {INX},             {SBC, CPU::_IMM},  {NOP},             {INTERPRET},
+    /* 0xEC */ {CPX, CPU::_ABS},  {SBC, CPU::_ABS},  {INC, CPU::_ABS},  {INTERPRET},
+
+    /* 0xF0 */ {BEQ},             {SBC, CPU::_IDY},  {INTERPRET},       {INTERPRET},
+    /* 0xF4 */ {INTERPRET},       {SBC, CPU::_ZPX},  {INC, CPU::_ZPX},  {INTERPRET},
+    /* 0xF8 */ {SED},             {SBC, CPU::_ABY},  {INTERPRET},       {INTERPRET},
+    /* 0xFC */ {INTERPRET},       {SBC, CPU::_ABX},  {INC, CPU::_ABX},  {INTERPRET},
+};
+
+
+///////////////////////////////////////////////
+// Setup & Block Lookup                      //
+///////////////////////////////////////////////
+
+
+// constructor
+Recompiler::Recompiler(CPU& newCpu, Bus& newBus, Logger& newLogger)
+    : cpu(newCpu), bus(newBus), logger(newLogger)
+{
+    u8* base = (u8*) &cpu;
+    offA = (u8*) &cpu.A - base;
+    offX = (u8*) &cpu.X - base;
+    offY = (u8*) &cpu.Y - base;
+    offSP = (u8*) &cpu.SP - base;
+    offP = (u8*) &cpu.P - base;
+    offPC = (u8*) &cpu.PC - base;
+    offCycles = (u8*) &cpu.cycles - base;
+    offFlagN = (u8*) &cpu.flagN - base;
+    offFlagZ = (u8*) &cpu.flagZ - base;
+    offOP = (u8*) &cpu.OP - base;
+    offOperand = (u8*) &cpu.operand - base;
+    offEvents = (u8*) &cpu.events - base;
+    writePagesDelta = (u8*) bus.getWritePages() - (u8*) bus.getReadPages();
+
+#if defined(__x86_64__)
+    void* memory = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED){
+        logger << Logger::logType::LOG_ERROR
+            << "Could not map memory for recompiled code"
+            << Logger::logType::LOG_ENDLINE;
+        return;
+    }
+    code = (u8*) memory;
+    emitStubs();
+    mprotect(code, CODE_SIZE, PROT_READ | PROT_EXEC);
+#endif
+}
+
+
+Recompiler::~Recompiler(){
+    if (code)
+        munmap(code, CODE_SIZE);
+}
+
+
+bool Recompiler::isReady(){
+    return code != nullptr;
+}
+
+
+bool Recompiler::run(u64 target){
+    u32 key = (bus.getPrgBank(cpu.PC) << 16) | cpu.PC;
+    const u8* block;
+    auto found = blocks.find(key);
+    if (found != blocks.end()){
+        block = found->second;
+    } else {
+        block = compile(cpu.PC);
+        blocks[key] = block;
+    }
+    if (!block)
+        return false;
+    enter(&cpu, target, block);
+    return true;
+}
+
+
+void Recompiler::flush(){
+    blocks.clear();
+    codeUsed = stubsSize;
+}
+
+
+void Recompiler::setSingleStep(bool enable){
+    singleStep = enable;
+}
+
+
+// Blocks are entered through a stub that saves the host registers and
+// loads the pinned ones, and all leave through the one that undoes it
+void Recompiler::emitStubs(){
+    Emitter e(code);
+    enter = (Entry) e.p;
+    for (int reg : {RBX, RBP, R12, R13, R14, R15})
+        e.push(reg);
+    e.alu64Imm(ALU_SUB, RSP, 24);
+    e.mov64(REG_CPU, RDI);
+    e.store64(RSP, 0, RSI);
+    e.movImm64(RBP, (u64) bus.getReadPages());
+    e.load8(REG_A, REG_CPU, offA);
+    e.load8(REG_X, REG_CPU, offX);
+    e.load8(REG_Y, REG_CPU, offY);
+    e.load64(REG_CYCLES, REG_CPU, offCycles);
+    e.jmpReg(RDX);
+
+    exitStub = e.p;
+    e.store8(REG_CPU, offA, REG_A);
+    e.store8(REG_CPU, offX, REG_X);
+    e.store8(REG_CPU, offY, REG_Y);
+    e.store64(REG_CPU, offCycles, REG_CYCLES);
+    e.alu64Imm(ALU_ADD, RSP, 24);
+    for (int reg : {R15, R14, R13, R12, RBP, RBX})
+        e.pop(reg);
+    e.ret();
+
+    stubsSize = e.p - code;
+    codeUsed = stubsSize;
+}
+
+
+// Translates the decoded block at PC, nullptr if it's empty. A full buffer
+// drops every block, decoded ones included, so both caches always
+// describe the same code
+const u8* Recompiler::compile(u16 address){
+    if (codeUsed + CODE_MARGIN > CODE_SIZE)
+        cpu.flushBlocks();
+
+    const CPU::DecodedBlock& block = cpu.getBlock();
+    if (block.empty())
+        return nullptr;
+    size_t count = singleStep ? 1 : std::min(block.size(), (size_t) MAX_BLOCK_INSTRUCTIONS);
+
+    mprotect(code, CODE_SIZE, PROT_READ | PROT_WRITE);
+    Emitter e(code + codeUsed);
+    const u8* start = e.p;
+    for (size_t i = 0; i < count; i++){
+        const CPU::DecodedInstruction& ins = block[i];
+        translate(e, ins.opcode, ins.operand, ins.cycles, address, i + 1 == count);
+        address += CPU::sizeTable[ins.opcode];
+    }
+    codeUsed = e.p - code;
+    mprotect(code, CODE_SIZE, PROT_READ | PROT_EXEC);
+    return start;
+}
+
+
+///////////////////////////////////////////////
+// Instructions                              //
+///////////////////////////////////////////////
+
+
+// Emits one instruction. Each one adds its base cycles up front, like
+// runBlock() does, and then either leaves the block or checks whether
+// the cycle target or an event ends it before the next instruction
+void Recompiler::translate(Emitter& e, u8 opcode, u16 operand, u8 cycles, u16 pc, bool last){
+    const Translation& t = translations[opcode];
+    u16 next = pc + CPU::sizeTable[opcode];
+
+    // only bus accesses can raise events, besides CLI and PLP unmasking one
+    bool events = t.mode != CPU::_IMM && t.mode != CPU::_ACC;
+    int reg = (t.op == LDX || t.op == STX || t.op == CPX) ? REG_X
+            : (t.op == LDY || t.op == STY || t.op == CPY) ? REG_Y : REG_A;
+
+    e.alu64Imm(ALU_ADD, REG_CYCLES, cycles);
+
+    switch (t.op){
+        case NOP:
+            break;
+
+        case ORA:
+        case AND:
+        case EOR:
+            emitOperand(e, t.mode, operand, next);
+            e.alu8(t.op == ORA ? 0x08 : t.op == AND ? 0x20 : 0x30, REG_A, RAX);
+            emitSetNZ(e, REG_A);
+            break;
+
+        // x86 carry and overflow come out the same as the 6502 ones,
+        // SBC just needs the carry flipped into a borrow and back
+        case ADC:
+        case SBC:
+            emitOperand(e, t.mode, operand, next);
+            e.load8(RCX, REG_CPU, offP);
+            e.bt32(RCX, 0);
+            if (t.op == SBC)
+                e.cmc();
+            e.alu8(t.op == ADC ? 0x10 : 0x18, REG_A, RAX);
+            e.setcc(t.op == ADC ? CC_B : CC_AE, RCX);
+            e.setcc(CC_O, RDX);
+            e.aluMem8(ALU_AND, REG_CPU, offP, 0xBE);
+            e.shift8Imm(SHIFT_SHL, RDX, 6);
+            e.alu8(0x08, RCX, RDX);
+            e.orMem8(REG_CPU, offP, RCX);
+            emitSetNZ(e, REG_A);
+            break;
+
+        case CMP:
+        case CPX:
+        case CPY:
+            emitOperand(e, t.mode, operand, next);
+            e.mov32(RCX, reg);
+            e.alu8(0x28, RCX, RAX);
+            e.setcc(CC_AE, RDX);
+            emitSetCarry(e, RDX);
+            emitSetNZ(e, RCX);
+            break;
+
+        case BIT:
+            emitOperand(e, t.mode, operand, next);
+            e.store8(REG_CPU, offFlagN, RAX);
+            e.mov32(RCX, RAX);
+            e.alu32Imm(ALU_AND, RCX, 0x40);
+            e.aluMem8(ALU_AND, REG_CPU, offP, 0xBF);
+            e.orMem8(REG_CPU, offP, RCX);
+            e.alu8(0x20, RAX, REG_A);
+            e.store8(REG_CPU, offFlagZ, RAX);
+            break;
+
+        case LDA:
+        case LDX:
+        case LDY:
+            emitOperand(e, t.mode, operand, next);
+            e.mov32(reg, RAX);
+            emitSetNZ(e, reg);
+            break;
+
+        case STA:
+        case STX:
+        case STY:
+            emitAddress(e, t.mode, operand, next, false);
+            e.mov32(RAX, reg);
+            emitWrite(e, next, false);
+            break;
+
+        // memory forms keep the original value in R8 for the write back
+        case ASL:
+        case LSR:
+        case ROL:
+        case ROR:
+            if (t.mode == CPU::_ACC){
+                e.mov32(RAX, REG_A);
+            } else {
+                emitAddress(e, t.mode, operand, next, false);
+                emitRead(e, next);
+                e.mov32(R8, RAX);
+            }
+            if (t.op == ROL || t.op == ROR){
+                e.load8(RCX, REG_CPU, offP);
+                e.bt32(RCX, 0);
+            }
+            e.shift8(t.op == ASL ? SHIFT_SHL : t.op == LSR ? SHIFT_SHR
+                : t.op == ROL ? SHIFT_RCL : SHIFT_RCR, RAX);
+            e.setcc(CC_B, RDX);
+            emitSetCarry(e, RDX);
+            emitSetNZ(e, RAX);
+            if (t.mode == CPU::_ACC)
+                e.mov32(REG_A, RAX);
+            else
+                emitWrite(e, next, true);
+            break;
+
+        case INC:
+        case DEC:
+            emitAddress(e, t.mode, operand, next, false);
+            emitRead(e, next);
+            e.mov32(R8, RAX);
+            if (t.op == INC)
+                e.inc8(RAX);
+            else
+                e.dec8(RAX);
+            emitSetNZ(e, RAX);
+            emitWrite(e, next, true);
+            break;
+
+        case INX: e.inc8(REG_X); emitSetNZ(e, REG_X); break;
+        case INY: e.inc8(REG_Y); emitSetNZ(e, REG_Y); break;
+        case DEX: e.dec8(REG_X); emitSetNZ(e, REG_X); break;
+        case DEY: e.dec8(REG_Y); emitSetNZ(e, REG_Y); break;
+        case TAX: e.mov32(REG_X, REG_A); emitSetNZ(e, REG_X); break;
+        case TAY: e.mov32(REG_Y, REG_A); emitSetNZ(e, REG_Y); break;
+        case TXA: e.mov32(REG_A, REG_X); emitSetNZ(e, REG_A); break;
+        case TYA: e.mov32(REG_A, REG_Y); emitSetNZ(e, REG_A); break;
+        case TSX: e.load8(REG_X, REG_CPU, offSP); emitSetNZ(e, REG_X); break;
+        case TXS: e.store8(REG_CPU, offSP, REG_X); break;
+
+        case CLC: e.aluMem8(ALU_AND, REG_CPU, offP, 0xFE); break;
+        case SEC: e.aluMem8(ALU_OR, REG_CPU, offP, 0x01); break;
+        case CLI: e.aluMem8(ALU_AND, REG_CPU, offP, 0xFB); events = true; break;
+        case SEI: e.aluMem8(ALU_OR, REG_CPU, offP, 0x04); break;
+        case CLV: e.aluMem8(ALU_AND, REG_CPU, offP, 0xBF); break;
+        case CLD: e.aluMem8(ALU_AND, REG_CPU, offP, 0xF7); break;
+        case SED: e.aluMem8(ALU_OR, REG_CPU, offP, 0x08); break;
+
+        case PHA:
+            e.mov32(RAX, REG_A);
+            emitPush(e, pc);
+            events = true;
+            break;
+
+        case PHP:
+            emitStatus(e);
+            e.alu32Imm(ALU_OR, RAX, 0x30);
+            emitPush(e, pc);
+            events = true;
+            break;
+
+        case PLA:
+            emitPull(e, pc);
+            e.mov32(REG_A, RAX);
+            emitSetNZ(e, REG_A);
+            events = true;
+            break;
+
+        case PLP:
+            emitPull(e, pc);
+            emitSetStatus(e);
+            events = true;
+            break;
+
+        // everything below ends the block
+        case JMP:
+            emitExit(e, operand);
+            return;
+
+        case JSR:
+            e.movImm32(RAX, (u16) (pc + 2) >> 8);
+            emitPush(e, next);
+            e.movImm32(RAX, (pc + 2) & 0xFF);
+            emitPush(e, next);
+            emitExit(e, operand);
+            return;
+
+        case RTS:
+        case RTI:
+            if (t.op == RTI){
+                emitPull(e, pc);
+                emitSetStatus(e);
+            }
+            emitPull(e, pc);
+            e.store32(RSP, 16, RAX);
+            emitPull(e, pc);
+            e.shift32Imm(SHIFT_SHL, RAX, 8);
+            e.or32(RAX, RSP, 16);
+            if (t.op == RTS)
+                e.inc32(RAX);
+            e.store16(REG_CPU, offPC, RAX);
+            e.jmpTo(exitStub);
+            return;
+
+        // Taken branches pay 1 or 2 extra cycles, known from the target.
+        // The test jumps over the taken path when the branch falls through
+        case BPL: case BMI: case BVC: case BVS:
+        case BCC: case BCS: case BNE: case BEQ: {
+            u16 target = next + (s8) operand;
+            u8* notTaken;
+            switch (t.op){
+                case BPL: e.testMem8(REG_CPU, offFlagN, 0x80); notTaken = e.jcc(CC_NE); break;
+                case BMI: e.testMem8(REG_CPU, offFlagN, 0x80); notTaken = e.jcc(CC_E); break;
+                case BVC: e.testMem8(REG_CPU, offP, 0x40); notTaken = e.jcc(CC_NE); break;
+                case BVS: e.testMem8(REG_CPU, offP, 0x40); notTaken = e.jcc(CC_E); break;
+                case BCC: e.testMem8(REG_CPU, offP, 0x01); notTaken = e.jcc(CC_NE); break;
+                case BCS: e.testMem8(REG_CPU, offP, 0x01); notTaken = e.jcc(CC_E); break;
+                case BNE: e.testMem8(REG_CPU, offFlagZ, 0xFF); notTaken = e.jcc(CC_E); break;
+                default:  e.testMem8(REG_CPU, offFlagZ, 0xFF); notTaken = e.jcc(CC_NE); break;
+            }
+            e.alu64Imm(ALU_ADD, REG_CYCLES, ((next ^ target) & 0xFF00) ? 2 : 1);
+            emitExit(e, target);
+            e.bind(notTaken);
+            emitExit(e, next);
+            return;
+        }
+
+        // the handler works on the CPU fields, so those have to be
+        // current going in and the pinned registers reloaded after
+        case INTERPRET:
+            emitSpill(e, pc);
+            e.store8Imm(REG_CPU, offOP, opcode);
+            e.store16Imm(REG_CPU, offOperand, operand);
+            emitCall(e, (const void*) &Recompiler::interpret);
+            e.load8(REG_A, REG_CPU, offA);
+            e.load8(REG_X, REG_CPU, offX);
+            e.load8(REG_Y, REG_CPU, offY);
+            e.load64(REG_CYCLES, REG_CPU, offCycles);
+            if (cpu.endsBlock(opcode)){
+                e.jmpTo(exitStub);
+                return;
+            }
+            events = true;
+            break;
+    }
+
+    if (last)
+        emitExit(e, next);
+    else
+        emitCheck(e, next, events);
+}
+
+
+///////////////////////////////////////////////
+// Addressing & Memory                       //
+///////////////////////////////////////////////
+
+
+// Effective address into ESI. Reads pay the page crossing cycle before
+// the access, like addPageCrossCycle() in the interpreter
+void Recompiler::emitAddress(Emitter& e, u8 mode, u16 operand, u16 next, bool read){
+    int index = (mode == CPU::_ZPY || mode == CPU::_ABY || mode == CPU::_IDY) ? REG_Y : REG_X;
+
+    switch (mode){
+        case CPU::_ZPG:
+        case CPU::_ABS:
+            e.movImm32(RSI, operand);
+            break;
+
+        case CPU::_ZPX:
+        case CPU::_ZPY:
+            e.mov32(RSI, index);
+            e.alu32Imm(ALU_ADD, RSI, operand);
+            e.movzx8(RSI, RSI);
+            break;
+
+        case CPU::_ABX:
+        case CPU::_ABY:
+            e.mov32(RSI, index);
+            e.alu32Imm(ALU_ADD, RSI, operand);
+            e.movzx16(RSI, RSI);
+            if (read){
+                e.mov32(RCX, index);
+                e.alu32Imm(ALU_ADD, RCX, operand & 0xFF);
+                e.shift32Imm(SHIFT_SHR, RCX, 8);
+                e.alu64(0x00, REG_CYCLES, RCX);
+            }
+            break;
+
+        // the pointer's low byte waits at [RSP+16] for the high one
+        case CPU::_IDX:
+            e.mov32(RSI, REG_X);
+            e.alu32Imm(ALU_ADD, RSI, operand & 0xFF);
+            e.movzx8(RSI, RSI);
+            emitRead(e, next);
+            e.store32(RSP, 16, RAX);
+            e.inc32(RSI);
+            e.movzx8(RSI, RSI);
+            emitRead(e, next);
+            e.shift32Imm(SHIFT_SHL, RAX, 8);
+            e.or32(RAX, RSP, 16);
+            e.mov32(RSI, RAX);
+            break;
+
+        case CPU::_IDY:
+            e.movImm32(RSI, operand & 0xFF);
+            emitRead(e, next);
+            e.store32(RSP, 16, RAX);
+            e.movImm32(RSI, (operand + 1) & 0xFF);
+            emitRead(e, next);
+            e.shift32Imm(SHIFT_SHL, RAX, 8);
+            e.or32(RAX, RSP, 16);
+            e.alu32(0x00, RAX, REG_Y);
+            e.movzx16(RSI, RAX);
+            if (read){
+                e.load32(RCX, RSP, 16);
+                e.alu32(0x00, RCX, REG_Y);
+                e.shift32Imm(SHIFT_SHR, RCX, 8);
+                e.alu64(0x00, REG_CYCLES, RCX);
+            }
+            break;
+    }
+}
+
+
+// value an instruction operates on into EAX
+void Recompiler::emitOperand(Emitter& e, u8 mode, u16 operand, u16 next){
+    if (mode == CPU::_IMM){
+        e.movImm32(RAX, operand & 0xFF);
+    } else {
+        emitAddress(e, mode, operand, next, true);
+        emitRead(e, next);
+    }
+}
+
+
+// Reads the byte at ESI into EAX through the page table, or the bus
+// when the page has no memory behind it. ESI survives either way
+void Recompiler::emitRead(Emitter& e, u16 pc){
+    e.mov32(RCX, RSI);
+    e.shift32Imm(SHIFT_SHR, RCX, 8);
+    e.loadPage(RDX, 0);
+    e.test64(RDX, RDX);
+    u8* slow = e.jcc(CC_E);
+    e.movzx8(RCX, RSI);
+    e.loadByte();
+    u8* done = e.jmp();
+
+    e.bind(slow);
+    emitSpill(e, pc);
+    e.store32(RSP, 8, RSI);
+    emitCall(e, (const void*) &Recompiler::readSlow);
+    e.movzx8(RAX, RAX);
+    e.load32(RSI, RSP, 8);
+    e.load64(REG_CYCLES, REG_CPU, offCycles);
+    e.bind(done);
+}
+
+
+// Writes AL to ESI. Read-modify-write instructions pass the
+// original value in R8, the bus has to see both writes
+void Recompiler::emitWrite(Emitter& e, u16 pc, bool writeBack){
+    e.mov32(RCX, RSI);
+    e.shift32Imm(SHIFT_SHR, RCX, 8);
+    e.loadPage(RDX, writePagesDelta);
+    e.test64(RDX, RDX);
+    u8* slow = e.jcc(CC_E);
+    e.movzx8(RCX, RSI);
+    e.storeByte();
+    u8* done = e.jmp();
+
+    e.bind(slow);
+    emitSpill(e, pc);
+    if (writeBack){
+        e.mov32(RDX, R8);
+        e.mov32(RCX, RAX);
+        emitCall(e, (const void*) &Recompiler::writeBackSlow);
+    } else {
+        e.mov32(RDX, RAX);
+        emitCall(e, (const void*) &Recompiler::writeSlow);
+    }
+    e.load64(REG_CYCLES, REG_CPU, offCycles);
+    e.bind(done);
+}
+
+
+// pushes AL, same order as CPU::pushStack()
+void Recompiler::emitPush(Emitter& e, u16 pc){
+    e.load8(RSI, REG_CPU, offSP);
+    e.alu32Imm(ALU_OR, RSI, 0x100);
+    emitWrite(e, pc, false);
+    e.decMem8(REG_CPU, offSP);
+}
+
+
+// pulls a byte into EAX
+void Recompiler::emitPull(Emitter& e, u16 pc){
+    e.incMem8(REG_CPU, offSP);
+    e.load8(RSI, REG_CPU, offSP);
+    e.alu32Imm(ALU_OR, RSI, 0x100);
+    emitRead(e, pc);
+}
+
+
+// EAX = CPU::getStatus()
+void Recompiler::emitStatus(Emitter& e){
+    e.load8(RAX, REG_CPU, offP);
+    e.alu32Imm(ALU_AND, RAX, 0x7D);
+    e.load8(RCX, REG_CPU, offFlagN);
+    e.alu32Imm(ALU_AND, RCX, 0x80);
+    e.alu32(0x08, RAX, RCX);
+    e.testMem8(REG_CPU, offFlagZ, 0xFF);
+    e.setcc(CC_E, RCX);
+    e.alu8(0x00, RCX, RCX);
+    e.alu32(0x08, RAX, RCX);
+}
+
+
+// CPU::setStatus() with the pulled byte in EAX, B cleared and bit 5 set
+void Recompiler::emitSetStatus(Emitter& e){
+    e.alu32Imm(ALU_AND, RAX, 0xEF);
+    e.alu32Imm(ALU_OR, RAX, 0x20);
+    e.store8(REG_CPU, offP, RAX);
+    e.store8(REG_CPU, offFlagN, RAX);
+    e.not32(RAX);
+    e.alu32Imm(ALU_AND, RAX, 0x02);
+    e.store8(REG_CPU, offFlagZ, RAX);
+}
+
+
+void Recompiler::emitSetNZ(Emitter& e, int reg){
+    e.store8(REG_CPU, offFlagN, reg);
+    e.store8(REG_CPU, offFlagZ, reg);
+}
+
+
+// carry from the 0/1 in the low byte of reg
+void Recompiler::emitSetCarry(Emitter& e, int reg){
+    e.aluMem8(ALU_AND, REG_CPU, offP, 0xFE);
+    e.orMem8(REG_CPU, offP, reg);
+}
+
+
+///////////////////////////////////////////////
+// Leaving Native Code                       //
+///////////////////////////////////////////////
+
+
+// Writes the pinned registers back before calling out. PC is what the
+// interpreter would have at that point, the bus and watches may look
+void Recompiler::emitSpill(Emitter& e, u16 pc){
+    e.store8(REG_CPU, offA, REG_A);
+    e.store8(REG_CPU, offX, REG_X);
+    e.store8(REG_CPU, offY, REG_Y);
+    e.store64(REG_CPU, offCycles, REG_CYCLES);
+    e.store16Imm(REG_CPU, offPC, pc);
+}
+
+
+// calls a helper with the CPU as its first argument
+void Recompiler::emitCall(Emitter& e, const void* function){
+    e.mov64(RDI, REG_CPU);
+    e.movImm64(RAX, (u64) function);
+    e.call(RAX);
+}
+
+
+// Leaves the block before the next instruction once the cycle target is
+// reached or, after anything that went to the bus, an event is pending.
+// A raised IRQ only counts with I clear, same as CPU::pendingEvents()
+void Recompiler::emitCheck(Emitter& e, u16 next, bool events){
+    e.cmp64(REG_CYCLES, RSP, 0);
+    u8* stop = e.jcc(CC_AE);
+    u8* stopEvents = nullptr;
+    u8* stopUnmasked = nullptr;
+    if (events){
+        e.load8(RAX, REG_CPU, offEvents);
+        e.test64(RAX, RAX);
+        u8* none = e.jcc(CC_E);
+        e.testMem8(REG_CPU, offP, 0x04);
+        stopUnmasked = e.jcc(CC_E);
+        e.alu32Imm(ALU_AND, RAX, (u8) ~CPU::EVENT_IRQ);
+        stopEvents = e.jcc(CC_NE);
+        e.bind(none);
+    }
+    u8* resume = e.jmp();
+
+    e.bind(stop);
+    if (events){
+        e.bind(stopUnmasked);
+        e.bind(stopEvents);
+    }
+    emitExit(e, next);
+    e.bind(resume);
+}
+
+
+void Recompiler::emitExit(Emitter& e, u16 pc){
+    e.store16Imm(REG_CPU, offPC, pc);
+    e.jmpTo(exitStub);
+}
+
+
+///////////////////////////////////////////////
+// Helpers Called From Native Code           //
+///////////////////////////////////////////////
+
+
+u8 Recompiler::readSlow(CPU* cpu, u16 address){
+    return cpu->read(address);
+}
+
+
+void Recompiler::writeSlow(CPU* cpu, u16 address, u8 value){
+    cpu->write(address, value);
+}
+
+
+void Recompiler::writeBackSlow(CPU* cpu, u16 address, u8 original, u8 value){
+    cpu->writeBack(address, original, value);
+}
+
+
+void Recompiler::interpret(CPU* cpu){
+    (cpu->*CPU::opcodeTable[cpu->OP])();
+}
+
+
+///////////////////////////////////////////////
+// Validation                                //
+///////////////////////////////////////////////
+
+
+// Registers plus every page the instruction could have written
+// without going through the bus. Mirrors are simply saved twice
+void Recompiler::save(State& state){
+    state.A = cpu.A;
+    state.X = cpu.X;
+    state.Y = cpu.Y;
+    state.SP = cpu.SP;
+    state.P = cpu.getStatus();
+    state.PC = cpu.PC;
+    state.cycles = cpu.cycles;
+
+    u8* const* pages = bus.getWritePages();
+    state.memory.clear();
+    for (int page = 0; page < 0x100; page++)
+        if (pages[page])
+            state.memory.insert(state.memory.end(), pages[page], pages[page] + 0x100);
+}
+
+
+void Recompiler::restore(const State& state){
+    cpu.A = state.A;
+    cpu.X = state.X;
+    cpu.Y = state.Y;
+    cpu.SP = state.SP;
+    cpu.setStatus(state.P);
+    cpu.PC = state.PC;
+    cpu.cycles = state.cycles;
+
+    u8* const* pages = bus.getWritePages();
+    const u8* saved = state.memory.data();
+    for (int page = 0; page < 0x100; page++){
+        if (pages[page]){
+            memcpy(pages[page], saved, 0x100);
+            saved += 0x100;
+        }
+    }
+}
+
+
+bool Recompiler::State::operator==(const State& other) const {
+    return A == other.A && X == other.X && Y == other.Y && SP == other.SP
+        && P == other.P && PC == other.PC && cycles == other.cycles
+        && memory == other.memory;
+}
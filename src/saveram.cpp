@@ -0,0 +1,140 @@
+#include <chrono>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/format.hpp>
+
+#include "../include/saveram.h"
+
+
+SaveRam::SaveRam(Logger& newLogger)
+    : logger(newLogger){}
+
+
+// Stops the flush thread and hands the last writes to the kernel.
+// This runs on the emulation thread when a cart unloads, so it doesn't
+// wait for the disk, the pages of a shared mapping outlive munmap
+SaveRam::~SaveRam(){
+    if (flusher.joinable()){
+        {
+            std::lock_guard<std::mutex> lock(flushMutex);
+            stopping = true;
+        }
+        flushWake.notify_one();
+        flusher.join();
+    }
+
+    if (data){
+        if (fd >= 0)
+            msync(data, size, MS_ASYNC);
+        munmap(data, size);
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+
+bool SaveRam::open(const std::string& path, u32 newSize){
+    int file = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (file < 0){
+        boost::format fmt = boost::format("Could not open save file %s") % path;
+        logger << Logger::logType::LOG_WARNING
+            << fmt.str()
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    // Two instances sharing the mapping would each see the other's
+    // writes land in their RAM mid frame, only the first one gets it
+    if (flock(file, LOCK_EX | LOCK_NB) != 0)
+        return openCopy(file, path, newSize);
+
+    // a new file reads back as zeros, an existing
+    // one is only ever grown, never truncated
+    struct stat info;
+    void* mapping = MAP_FAILED;
+    if (fstat(file, &info) == 0 && (info.st_size >= (off_t)newSize || ftruncate(file, newSize) == 0))
+        mapping = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+
+    if (mapping == MAP_FAILED){
+        close(file);
+        boost::format fmt = boost::format("Could not map save file %s") % path;
+        logger << Logger::logType::LOG_WARNING
+            << fmt.str()
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    // the lock lasts as long as the descriptor
+    data = (u8*)mapping;
+    size = newSize;
+    fd = file;
+    flusher = std::thread(&SaveRam::flushLoop, this);
+    return true;
+}
+
+
+// Loads the save into anonymous memory for an instance that lost the
+// lock. The game still sees its save, but nothing goes back to disk
+bool SaveRam::openCopy(int file, const std::string& path, u32 newSize){
+    void* mapping = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED){
+        close(file);
+        boost::format fmt = boost::format("Could not map save file %s") % path;
+        logger << Logger::logType::LOG_WARNING
+            << fmt.str()
+            << Logger::logType::LOG_ENDLINE;
+        return false;
+    }
+
+    // anonymous memory starts zeroed, so a short
+    // or failed read looks the same as a new file
+    if (pread(file, mapping, newSize, 0) < 0){
+        boost::format fmt = boost::format("Could not read save file %s") % path;
+        logger << Logger::logType::LOG_WARNING
+            << fmt.str()
+            << Logger::logType::LOG_ENDLINE;
+    }
+    close(file);
+
+    boost::format fmt = boost::format("Save file %s is in use by another instance, saves from this one won't be kept") % path;
+    logger << Logger::logType::LOG_WARNING
+        << fmt.str()
+        << Logger::logType::LOG_ENDLINE;
+
+    data = (u8*)mapping;
+    size = newSize;
+    return true;
+}
+
+
+u8* SaveRam::getData(){
+    return data;
+}
+
+
+u32 SaveRam::getSize(){
+    return size;
+}
+
+
+void SaveRam::flushLoop(){
+    std::unique_lock<std::mutex> lock(flushMutex);
+    while (!stopping){
+        flushWake.wait_for(lock, std::chrono::milliseconds(SAVE_FLUSH_INTERVAL_MS));
+        if (!stopping)
+            flush();
+    }
+}
+
+
+// the kernel tracks which pages are dirty, so
+// this only ever writes what the game touched
+void SaveRam::flush(){
+    if (fd >= 0)
+        msync(data, size, MS_SYNC);
+}
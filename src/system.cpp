@@ -8,7 +8,7 @@
 
 
 System::System(std::string name, Logger& newLogger)
-    : systemName(name), logger(newLogger)
+    : logger(newLogger), library(newLogger), systemName(name)
 {
     bus = std::make_unique<Bus>(logger);
     cpu = std::make_unique<CPU>(*bus, logger);
@@ -25,23 +25,30 @@ System::System(std::string name, Logger& newLogger)
 
 
 // load cart from filepath (for testing)
-void System::loadCart(char* filepath){
-    cart = std::make_unique<Cart>(filepath, logger);
+bool System::loadCart(char* filepath){
+    // a cart that didn't load never gets connected,
+    // whatever was running before keeps running
+    std::unique_ptr<Cart> newCart = std::make_unique<Cart>(filepath, logger);
+    if (!newCart->isLoaded())
+        return false;
+
+    cart = std::move(newCart);
     bus->connectCart(*cart);
     ppu->connectCart(*cart);
+    cpu->flushBlocks();
+    cpu->reset();
     cartLoaded = true;
+    setRunning(true);
+    return true;
 }
 
 
 // load cart from filesystem selection window
-void System::loadCart(){
+bool System::loadCart(){
     char* filepath = openFileSystem();
-    cart = std::make_unique<Cart>(filepath, logger);
-
-    bus->connectCart(*cart);
-    ppu->connectCart(*cart);
-    cartLoaded = true;
+    bool loaded = loadCart(filepath);
     delete filepath;
+    return loaded;
 }
 
 
@@ -54,13 +61,49 @@ void System::setImguiDemo(bool isDemo){
 // Loads Blarggs NesTest.nes & sets emulator to run
 void System::setTesting(bool isTesting){
     if (isTesting){
-        loadCart("./test/nestest.nes");
+        // nestest's automated mode starts at $C000 instead of the reset vector
+        if (!loadCart("./test/nestest.nes"))
+            return;
         cpu->PC = 0xC000;
+        cpu->setTracing(true);
+
+        // nestest reports failing tests in $02/$03
+        bus->addWatch(0x02, 0x03, [this](u16 address, u8 data){
+            if (address == 0x02)
+                cpu->error1 = data;
+            else
+                cpu->error2 = data;
+        });
         setRunning(true);
     }
 }
 
 
+// Traces every instruction executed during frames [first, last]
+void System::setTraceFrames(u64 first, u64 last){
+    traceFrames = true;
+    traceFirstFrame = first;
+    traceLastFrame = last;
+}
+
+
+// limits tracing to instructions with PC in [first, last]
+void System::setTraceRange(u16 first, u16 last){
+    cpu->setTraceRange(first, last);
+}
+
+
+// indexes every ROM under the directories, unchanged files come from the index
+void System::scanLibrary(const std::vector<std::string>& directories){
+    library.scan(directories);
+}
+
+
+const std::vector<LibraryEntry>& System::getLibrary(){
+    return library.getEntries();
+}
+
+
 // Where the action happens!
 int System::mainLoop(){
 
@@ -81,8 +124,8 @@ int System::mainLoop(){
         gui->NewFrame();
 
         // System Events
-        if (cartLoaded) 
-            cpu->tick();
+        if (cartLoaded && running) 
+            tick();
 
         // Demo Window (set by argument flag `--demo, -d`)
         if (demoMode)
@@ -112,8 +155,24 @@ int System::mainLoop(){
 ///////////////////////////////////////////////
 
 
+// Runs the CPU up to the PPU's next event and catches the PPU up
+// there, until the PPU finishes a frame or a breakpoint is hit.
+// In between, the PPU only runs when the CPU touches its registers
 void System::tick(){
-    cpu->tick();
+    if (traceFrames)
+        cpu->setTracing(frameCount >= traceFirstFrame && frameCount <= traceLastFrame);
+
+    u64 startFrame = ppu->frameCount;
+    while (ppu->frameCount == startFrame){
+        u64 deadline = ppu->nextEvent();
+        cpu->run(deadline > cpu->cycles ? deadline - cpu->cycles : 1);
+        ppu->catchUp(cpu->cycles);
+        if (cpu->atBreakpoint())
+            break;
+    }
+    frameCount++;
+    if (cpu->atBreakpoint())
+        setRunning(false);
 }
 
 
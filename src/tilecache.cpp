@@ -0,0 +1,144 @@
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "../include/tilecache.h"
+
+
+///////////////////////////////////////////////
+// Bitplane expansion                        //
+///////////////////////////////////////////////
+
+
+// Each kernel turns a tile's two bitplanes (8 bytes low plane, then
+// 8 bytes high plane) into 64 pixels of 0-3, plus the same rows mirrored.
+// Every row byte is spread over the 8 lanes of its pixels, and each lane
+// tests its own bit, so a whole vector of pixels comes out of one compare
+
+#if defined(__AVX2__)
+
+// one bit per lane, leftmost pixel first, for 4 rows at a time
+static inline __m256i testBits(__m256i low, __m256i high, __m256i bits){
+    __m256i lowSet = _mm256_cmpeq_epi8(_mm256_and_si256(low, bits), bits);
+    __m256i highSet = _mm256_cmpeq_epi8(_mm256_and_si256(high, bits), bits);
+    return _mm256_or_si256(_mm256_and_si256(lowSet, _mm256_set1_epi8(1)),
+        _mm256_and_si256(highSet, _mm256_set1_epi8(2)));
+}
+
+
+static void expandTile(const u8* planes, u8* out, u8* flipped){
+    // shuffles work within 128 bit lanes, so both lanes get the whole plane
+    __m256i low = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i*)planes));
+    __m256i high = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i*)(planes + 8)));
+
+    const __m256i spread[2] = {
+        _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                         2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3),
+        _mm256_setr_epi8(4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5,
+                         6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7),
+    };
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080ll);
+    const __m256i bitsFlipped = _mm256_set1_epi64x(0x8040201008040201ll);
+
+    for (int half = 0; half < 2; half++){
+        __m256i rowsLow = _mm256_shuffle_epi8(low, spread[half]);
+        __m256i rowsHigh = _mm256_shuffle_epi8(high, spread[half]);
+        _mm256_storeu_si256((__m256i*)(out + half * 32), testBits(rowsLow, rowsHigh, bits));
+        _mm256_storeu_si256((__m256i*)(flipped + half * 32), testBits(rowsLow, rowsHigh, bitsFlipped));
+    }
+}
+
+#elif defined(__SSE2__)
+
+// one bit per lane, leftmost pixel first, for 2 rows at a time
+static inline __m128i testBits(__m128i low, __m128i high, __m128i bits){
+    __m128i lowSet = _mm_cmpeq_epi8(_mm_and_si128(low, bits), bits);
+    __m128i highSet = _mm_cmpeq_epi8(_mm_and_si128(high, bits), bits);
+    return _mm_or_si128(_mm_and_si128(lowSet, _mm_set1_epi8(1)),
+        _mm_and_si128(highSet, _mm_set1_epi8(2)));
+}
+
+
+// no byte shuffle in SSE2, so the rows are doubled up with unpacks
+// until each byte fills 8 lanes: rows 0-1, 2-3, 4-5 and 6-7
+static inline void spreadRows(__m128i plane, __m128i rows[4]){
+    __m128i pairs = _mm_unpacklo_epi8(plane, plane);
+    __m128i quadsLow = _mm_unpacklo_epi16(pairs, pairs);
+    __m128i quadsHigh = _mm_unpackhi_epi16(pairs, pairs);
+    rows[0] = _mm_unpacklo_epi32(quadsLow, quadsLow);
+    rows[1] = _mm_unpackhi_epi32(quadsLow, quadsLow);
+    rows[2] = _mm_unpacklo_epi32(quadsHigh, quadsHigh);
+    rows[3] = _mm_unpackhi_epi32(quadsHigh, quadsHigh);
+}
+
+
+static void expandTile(const u8* planes, u8* out, u8* flipped){
+    __m128i low[4], high[4];
+    spreadRows(_mm_loadl_epi64((const __m128i*)planes), low);
+    spreadRows(_mm_loadl_epi64((const __m128i*)(planes + 8)), high);
+
+    const __m128i bits = _mm_set1_epi64x(0x0102040810204080ll);
+    const __m128i bitsFlipped = _mm_set1_epi64x(0x8040201008040201ll);
+
+    for (int i = 0; i < 4; i++){
+        _mm_storeu_si128((__m128i*)(out + i * 16), testBits(low[i], high[i], bits));
+        _mm_storeu_si128((__m128i*)(flipped + i * 16), testBits(low[i], high[i], bitsFlipped));
+    }
+}
+
+#else
+
+static void expandTile(const u8* planes, u8* out, u8* flipped){
+    for (int y = 0; y < 8; y++){
+        for (int x = 0; x < 8; x++){
+            int shift = 7 - x;
+            u8 pixel = (((planes[y + 8] >> shift) & 0x01) << 1) | ((planes[y] >> shift) & 0x01);
+            out[y * 8 + x] = pixel;
+            flipped[y * 8 + 7 - x] = pixel;
+        }
+    }
+}
+
+#endif
+
+
+///////////////////////////////////////////////
+// Cache                                     //
+///////////////////////////////////////////////
+
+
+// a new cart starts out with nothing decoded
+void TileCache::connectCart(Cart& newCart){
+    cart = &newCart;
+    memset(windows, 0, sizeof(windows));
+    memset(valid, 0, sizeof(valid));
+}
+
+
+// A window pointing somewhere new drops its 64 tiles at once,
+// CHR RAM writes only drop the tiles they landed in, in every
+// window the written bank is mapped into
+void TileCache::sync(){
+    bool chrRam = cart->hasChrRam();
+    for (int window = 0; window < 8; window++){
+        const u8* data = cart->getChrPointer(window * 0x400);
+        if (data != windows[window]){
+            windows[window] = data;
+            valid[window] = 0;
+        }
+        else if (chrRam){
+            valid[window] &= ~cart->getChrRamDirty(data);
+        }
+    }
+
+    if (chrRam)
+        cart->clearChrRamDirty();
+}
+
+
+void TileCache::decode(u16 tile){
+    expandTile(cart->getChrPointer(tile << 4), pixels[0][tile], pixels[1][tile]);
+    valid[tile >> 6] |= 1ull << (tile & 63);
+}